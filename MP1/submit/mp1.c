@@ -1,203 +1,3024 @@
 #define LINUX
 
+#include <linux/version.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
-#include <linux/list.h>
 #include <linux/string.h>
 #include <linux/timer.h>
 #include <linux/spinlock.h>
 #include <linux/workqueue.h>
+#include <linux/tracepoint.h>
+#include <linux/atomic.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/kref.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/sort.h>
+#include <linux/bitops.h>
+#include <linux/cred.h>
+#include <linux/capability.h>
 #include <asm/uaccess.h>
 #include "mp1_given.h"
 
 #define DEBUG 1
 #define PROCFS_MAX_SIZE 1024
 #define FILENAME "status"
+#define EVENTS_FILENAME "events"
+#define EXPORT_FILENAME "export"
+#define REGISTRY_FILENAME "registry"
+#define SESSION_FILENAME "session"
 #define DIRECTORY "mp1"
+#define UPDATE_PERIOD (5 * HZ)
+#define SESSION_MIN_PERIOD_MS 100
+#define SESSION_MAX_PER_USER 8
+#define EVENT_RING_SIZE 256
+#define TOMB_RING_SIZE 1024
+#define TABLE_MIN_CAPACITY 64
+#define SWITCH_SLOT_BITS 8
+#define SWITCH_SLOTS (1 << SWITCH_SLOT_BITS)
+#define BURST_BUCKETS 8
+#define WAIT_WINDOW 16
+
+// Run-queue delay is only tracked by the kernel with one of these
+#if defined(CONFIG_SCHEDSTATS) || defined(CONFIG_TASK_DELAY_ACCT)
+#define HAVE_SCHED_INFO 1
+#endif
+
+// Storage I/O bytes likewise
+#ifdef CONFIG_TASK_IO_ACCOUNTING
+#define HAVE_IO_ACCOUNTING 1
+#endif
+
+// The sched_switch tracepoint gained a preempt argument in 4.4, probes are
+//  registered through a void pointer so a mismatch would only show at runtime
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+#define SWITCH_PROBE_ARGS void *data, bool preempt, struct task_struct *prev, struct task_struct *next
+#else
+#define SWITCH_PROBE_ARGS void *data, struct task_struct *prev, struct task_struct *next
+#endif
+
+// Registration flags
+#define PROC_FOLLOW_FORKS 0x1
+#define PROC_METRIC_RSS 0x2
+#define PROC_METRIC_FAULTS 0x4
+#define PROC_METRIC_IO 0x8
+#define PROC_METRICS (PROC_METRIC_RSS | PROC_METRIC_FAULTS | PROC_METRIC_IO)
+#define PROC_OPTION_FLAGS (PROC_FOLLOW_FORKS | PROC_METRICS)
+
+// The registering user had CAP_KILL, inherited by followed forks with the owner
+#define PROC_CAP_KILL 0x10
+#define PROC_INHERITED_FLAGS (PROC_OPTION_FLAGS | PROC_CAP_KILL)
+
+// Sampling state flags
+#define PROC_SAMPLED 0x100
+#define PROC_BUDGET_HIT 0x200
+#define PROC_RATE_HIT 0x400
+#define PROC_STOPPED 0x800
+
+// What to do to a process crossing its budget or rate limit
+enum proc_action
+{
+    ACTION_NOTIFY = 0,
+    ACTION_THROTTLE,
+    ACTION_KILL,
+};
+
+// Kinds of notification in the 'events' file
+enum proc_event_type
+{
+    EVENT_LOST = 0,
+    EVENT_BUDGET,
+    EVENT_RATE,
+    EVENT_RATE_CLEAR,
+    EVENT_EXIT,
+};
+
+static const char *event_names[] = { "lost", "budget", "rate", "rate_clear", "exit" };
+
+// Histogram of on-CPU burst lengths, bucket b counts bursts
+//  shorter than 4^(b + 6) ns (4us, 16us, ..., 16ms, longer)
+typedef u32 burst_hist_t[BURST_BUCKETS];
+
+// Run-queue wait of the last WAIT_WINDOW sampling periods, in us
+typedef u32 wait_window_t[WAIT_WINDOW];
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("G14");
 MODULE_DESCRIPTION("CS-423 MP1");
 
-/* Variable declaration */
+static bool exact;
+module_param(exact, bool, 0444);
+MODULE_PARM_DESC(exact, "Account on-CPU time at every context switch instead of sampling utime");
+
+/* Variable declaration */
+
+static struct proc_dir_entry *mp1, *status;
+static struct workqueue_struct *update_workqueue;
+static atomic_t follow_count = ATOMIC_INIT(0);
+
+// Set when the module starts unloading, blocked event readers return
+static bool unloading;
+
+// Monotonic time of loading, processes started later were never dumped
+static u64 loaded_at;
+static struct tracepoint *fork_tracepoint;
+
+// Ring of pending notifications, overwrites the oldest when full
+struct proc_event
+{
+    int pid;
+    enum proc_event_type type;
+    unsigned long value;
+};
+
+static struct proc_dir_entry *events;
+
+// Each registry has its own ring, tenants do not see each other's processes
+struct proc_events
+{
+    struct proc_event ring[EVENT_RING_SIZE];
+    unsigned int head, tail;
+    unsigned long lost;
+    spinlock_t lock;
+    wait_queue_head_t wait;
+};
+
+// PID removed in a sweep
+struct proc_tomb
+{
+    int pid;
+    u64 gen;
+};
+
+static struct proc_dir_entry *export;
+
+// Immutable copy of the registry published by each sweep,
+//  readers hold a reference for as long as the file is open
+struct snap_entry
+{
+    int pid;
+    int parent;
+    unsigned long cpu_use;
+    u64 changed_gen;
+    
+    // Exact mode only
+    u64 oncpu_ns;
+    burst_hist_t hist;
+    
+    // Run-queue wait and timeslices in the last period, wait percentiles over the window
+    u32 wait_us;
+    u32 slices;
+    u32 wait_p50;
+    u32 wait_p90;
+    u32 wait_max;
+    
+    // Only the metrics selected at registration are filled in
+    unsigned int metrics;
+    unsigned long rss;
+    unsigned long min_flt;
+    unsigned long maj_flt;
+    u64 read_bytes;
+    u64 write_bytes;
+};
+
+struct proc_snapshot
+{
+    struct kref ref;
+    u64 gen;
+    
+    // Removals still remembered when the snapshot was taken
+    u64 tomb_floor;
+    unsigned int tomb_count;
+    struct proc_tomb *tombs;
+    
+    unsigned int count;
+    struct snap_entry entries[];
+};
+
+// Per-open state of the 'export' entry
+struct export_request
+{
+    u64 since;
+    struct proc_snapshot *snap;
+};
+
+// On-disk layout of the 'registry' entry, little endian
+struct registry_header
+{
+    char magic[4];
+    __le32 version;
+    __le32 record_size;
+    __le32 count;
+    __le64 gen;
+};
+
+struct registry_record
+{
+    __le32 pid;
+    __le32 parent;
+    __le32 flags;
+    __le32 action;
+    __le32 rate;
+    __le32 wait_count;
+    __le64 budget;
+    __le64 cpu_use;
+    __le64 oncpu_ns;
+    __le32 hist[BURST_BUCKETS];
+    __le32 waits[WAIT_WINDOW];
+    __le64 start_time;
+};
+
+// Per-open state of a restore through the 'registry' entry
+struct restore_state
+{
+    struct registry_header header;
+    u8 *record;
+    size_t have;
+    u32 record_size;
+    u32 remaining;
+    unsigned int restored;
+    unsigned int skipped;
+};
+
+static struct proc_dir_entry *registry, *session;
+
+/* Table of registered processes
+ *
+ * One array per field instead of one node per process, so the sweep streams
+ * through each array linearly. New rows are appended, and rows of exited
+ * processes are squeezed out while the sweep walks the table, so live rows
+ * always stay packed at [0, count). A hash index from PID to row keeps
+ * lookups and inserts constant time, the sweep rebuilds it after compacting.
+ */
+
+// Every column of the table, fields the sweep touches first
+#define TABLE_COLUMNS(C) \
+    C(int, pid) \
+    C(struct pid *, task) \
+    C(unsigned long, cpu_use) \
+    C(unsigned long, stamp) \
+    C(unsigned int, flags) \
+    C(u64, changed_gen) \
+    C(u64, oncpu_ns) \
+    C(burst_hist_t, hist) \
+    C(u64, run_delay) \
+    C(unsigned long, pcount) \
+    C(u32, slices) \
+    C(wait_window_t, waits) \
+    C(unsigned int, wait_count) \
+    C(unsigned long, rss) \
+    C(unsigned long, min_flt) \
+    C(unsigned long, maj_flt) \
+    C(u64, read_bytes) \
+    C(u64, write_bytes) \
+    C(int, parent) \
+    C(unsigned long, budget) \
+    C(unsigned int, rate) \
+    C(u8, action) \
+    C(kuid_t, owner)
+
+#define TABLE_DECLARE(type, name) type *name;
+
+struct proc_table
+{
+    unsigned int count;
+    unsigned int capacity;
+    
+    // Single allocation holding every column and the index
+    void *block;
+    
+    // Open addressing, row + 1 per entry and 0 if free,
+    //  at least twice as many entries as rows so probes stay short
+    unsigned int index_bits;
+    unsigned int *index;
+    
+    TABLE_COLUMNS(TABLE_DECLARE)
+};
+
+/* Registries
+ *
+ * The 'status' entry and the other global files share one registry. Every open
+ * of the 'session' entry creates another one with its own table, sampling
+ * period and snapshots, freed when the file is closed.
+ */
+
+struct proc_registry
+{
+    // Member of the registries list
+    struct list_head list;
+    
+    // Guards the table, the sweep generation and the removals
+    spinlock_t table_lock;
+    struct proc_table table;
+    
+    // Sweep generation and the PIDs removed recently,
+    //  only the exported global registry remembers removals
+    u64 sweep_gen;
+    struct proc_tomb *tomb_ring;
+    unsigned int tomb_head;
+    u64 tomb_floor;
+    
+    // Latest snapshot
+    spinlock_t snap_lock;
+    struct proc_snapshot *current_snap;
+    
+    // Notifications of limit crossings and exits
+    struct proc_events events;
+    
+    // User who opened the session, unused by the global registry
+    bool session;
+    kuid_t owner;
+    
+    // Reads of the session return its events instead of its status
+    bool read_events;
+    
+    // Periodic sweep
+    unsigned long period;
+    struct timer_list timer;
+    struct work_struct work;
+    
+    // Followed forks that found the table full, grow_work makes room for them
+    struct list_head pending;
+    unsigned int pending_count;
+    struct work_struct grow_work;
+};
+
+static struct proc_registry *global_registry;
+static LIST_HEAD(registries);
+static DEFINE_SPINLOCK(registries_lock);
+
+/* Exact accounting
+ *
+ * With exact=1 the sched_switch tracepoint measures every stretch a registered
+ * process spends on a CPU. The probe adds it to a small per-CPU table keyed by
+ * PID, and the sweep merges those tables into the registry. A bitmap of
+ * registered PIDs lets the probe skip every other task with a single bit test.
+ */
+
+struct switch_slot
+{
+    int pid;
+    u64 ns;
+    burst_hist_t hist;
+};
+
+struct switch_cpu
+{
+    raw_spinlock_t lock;
+    
+    // Registered process currently on this CPU, when it got there
+    //  and up to when its time has been charged already
+    int pid;
+    u64 started;
+    u64 since;
+    
+    // Time that found no free slot before the next merge
+    u64 lost_ns;
+    
+    struct switch_slot slots[SWITCH_SLOTS];
+};
+
+static struct switch_cpu __percpu *switch_cpus;
+static unsigned long *switch_pids;
+static struct tracepoint *switch_tracepoint;
+
+// Options of one registration, parsed from the 'status' entry
+struct proc_item
+{
+    int pid;
+    
+    // PID of the registered process that forked this one, 0 if registered directly
+    int parent;
+    unsigned int flags;
+    
+    // CPU limits in cpu_use units, 0 if unlimited
+    unsigned long budget;
+    unsigned int rate;
+    enum proc_action action;
+    
+    // User the throttle and kill actions are taken on behalf of
+    kuid_t owner;
+};
+
+// Followed fork waiting for room in the table
+struct proc_pending
+{
+    struct list_head list;
+    struct proc_item item;
+    struct pid *task;
+};
+
+/* Function forward declaration */
+
+static int _proc_show_callback(struct seq_file *sf, void *v);
+static int _proc_open_callback(struct inode *inode, struct file *file);
+static ssize_t _proc_write_callback(struct file *file, const char __user *buffer, size_t count, loff_t *data);
+static int _proc_release_callback(struct inode *inode, struct file *file);
+static void _show_snapshot(struct seq_file *sf, struct proc_snapshot *snap);
+static int _parse_registration(char *input, struct proc_item *item);
+static int _register(struct proc_registry *reg, char *input);
+static bool _uid_may_signal(kuid_t uid, struct task_struct *task);
+static int _check_owner(struct proc_item *item, struct pid *task);
+
+static int _table_alloc(struct proc_table *t, unsigned int capacity);
+static void _table_copy(struct proc_table *dst, unsigned int to, struct proc_table *src, unsigned int from, unsigned int n);
+static void _table_clear(struct proc_registry *reg, unsigned int row);
+static int _table_reserve(struct proc_registry *reg, unsigned int want);
+static unsigned int _table_find(struct proc_registry *reg, int pid, bool *found);
+static void _table_index(struct proc_table *t, unsigned int row);
+static void _table_reindex(struct proc_table *t);
+static int _table_insert(struct proc_registry *reg, struct proc_item *item, struct pid *task);
+static bool _registered_elsewhere(struct proc_registry *self, int pid);
+
+static void _fork_probe(void *data, struct task_struct *parent, struct task_struct *child);
+static struct proc_pending *_pending_find(struct proc_registry *reg, int pid);
+static void _grow_work(struct work_struct *work);
+static struct tracepoint *_find_tracepoint(const char *name);
+
+static void _switch_charge(struct switch_cpu *sc, u64 ns, unsigned int bucket);
+static void _switch_probe(SWITCH_PROBE_ARGS);
+static void _switch_merge(void);
+static u64 _oncpu_seed(struct pid *task);
+static u64 _oncpu_unmerged(int pid);
+
+static void _sample_wait(struct proc_registry *reg, unsigned int row, struct task_struct *task);
+static void _wait_percentiles(struct proc_registry *reg, unsigned int row, struct snap_entry *entry);
+
+static int _parse_metrics(char *list, unsigned int *flags);
+static void _sample_metrics(struct proc_registry *reg, unsigned int row, struct task_struct *task);
+
+static void _post_event(struct proc_registry *reg, int pid, enum proc_event_type type, unsigned long value);
+static ssize_t _events_read(struct proc_events *ev, struct file *file, char __user *buffer, size_t count);
+static unsigned int _events_poll(struct proc_events *ev, struct file *file, poll_table *wait);
+static void _check_limits(struct proc_registry *reg, unsigned int slot, struct task_struct *task, unsigned long last_cpu_use, unsigned long elapsed);
+static ssize_t _events_read_callback(struct file *file, char __user *buffer, size_t count, loff_t *data);
+static unsigned int _events_poll_callback(struct file *file, poll_table *wait);
+
+static struct proc_snapshot *_snap_alloc(unsigned int count, unsigned int tombs);
+static void _snap_release(struct kref *ref);
+static struct proc_snapshot *_snap_get(struct proc_registry *reg);
+static void _snap_put(struct proc_snapshot *snap);
+static void _snap_publish(struct proc_registry *reg, struct proc_snapshot *snap);
+static int _snap_entry_cmp(const void *a, const void *b);
+
+static void _bury(struct proc_registry *reg, int pid);
+static int _export_show_callback(struct seq_file *sf, void *v);
+static int _export_open_callback(struct inode *inode, struct file *file);
+static ssize_t _export_write_callback(struct file *file, const char __user *buffer, size_t count, loff_t *data);
+static int _export_release_callback(struct inode *inode, struct file *file);
+
+static int _registry_show_callback(struct seq_file *sf, void *v);
+static int _registry_open_callback(struct inode *inode, struct file *file);
+static ssize_t _registry_write_callback(struct file *file, const char __user *buffer, size_t count, loff_t *data);
+static int _registry_release_callback(struct inode *inode, struct file *file);
+static loff_t _registry_llseek_callback(struct file *file, loff_t offset, int whence);
+static void _restore_record(struct restore_state *rs);
+
+static int _session_open_callback(struct inode *inode, struct file *file);
+static int _session_show_callback(struct seq_file *sf, void *v);
+static ssize_t _session_write_callback(struct file *file, const char __user *buffer, size_t count, loff_t *data);
+static int _session_release_callback(struct inode *inode, struct file *file);
+static ssize_t _session_read_callback(struct file *file, char __user *buffer, size_t count, loff_t *data);
+static unsigned int _session_poll_callback(struct file *file, poll_table *wait);
+
+static struct proc_registry *_registry_create(unsigned long period, bool session);
+static void _registry_destroy(struct proc_registry *reg);
+static void _registry_free(struct proc_registry *reg);
+
+void _update_timer_handler(unsigned long data);
+static void update_work(struct work_struct *work);
+
+/* I/O of the ProcFS */
+
+static const struct file_operations cpu_proc_fops = {
+    .owner = THIS_MODULE,
+    .open = _proc_open_callback,
+    .read = seq_read,
+    .write = _proc_write_callback,
+    .llseek = seq_lseek,
+    .release = _proc_release_callback,
+};
+
+// Read the 'status' entry,
+//  the reader sees the sweep that was the latest when it opened the file
+static int _proc_open_callback(struct inode *inode, struct file *file)
+{
+    struct proc_snapshot *snap = _snap_get(global_registry);
+    int ret;
+    
+    ret = single_open(file, _proc_show_callback, snap);
+    if (ret)
+    {
+        _snap_put(snap);
+    }
+    
+    return ret;
+}
+
+static int _proc_show_callback(struct seq_file *sf, void *v)
+{
+    _show_snapshot(sf, sf->private);
+    
+    return 0;
+}
+
+// Print a snapshot in the format of the 'status' entry
+static void _show_snapshot(struct seq_file *sf, struct proc_snapshot *snap)
+{
+    struct snap_entry *cur;
+    unsigned int i, b;
+    
+    // Tell the reader which sweep it is looking at
+    seq_printf(sf, "# generation %llu\n", snap->gen);
+    
+    // Iterate the snapshot,
+    //  print to the console "[PID]: [cpu_use]" for each registered process
+    for (i = 0; i < snap->count; i++)
+    {
+        cur = &snap->entries[i];
+        seq_printf(sf, "%d: %lu", cur->pid, cur->cpu_use);
+        if (cur->parent)
+        {
+            seq_printf(sf, " parent=%d", cur->parent);
+        }
+        if (exact)
+        {
+            seq_printf(sf, " oncpu_ns=%llu bursts=%u", cur->oncpu_ns, cur->hist[0]);
+            for (b = 1; b < BURST_BUCKETS; b++)
+            {
+                seq_printf(sf, ",%u", cur->hist[b]);
+            }
+        }
+#ifdef HAVE_SCHED_INFO
+        seq_printf(sf, " wait_us=%u slices=%u wait_p50=%u wait_p90=%u wait_max=%u",
+                   cur->wait_us, cur->slices, cur->wait_p50, cur->wait_p90, cur->wait_max);
+#endif
+        if (cur->metrics & PROC_METRIC_RSS)
+        {
+            seq_printf(sf, " rss_kb=%lu", cur->rss << (PAGE_SHIFT - 10));
+        }
+        if (cur->metrics & PROC_METRIC_FAULTS)
+        {
+            seq_printf(sf, " minflt=%lu majflt=%lu", cur->min_flt, cur->maj_flt);
+        }
+        if (cur->metrics & PROC_METRIC_IO)
+        {
+            seq_printf(sf, " read_bytes=%llu write_bytes=%llu", cur->read_bytes, cur->write_bytes);
+        }
+        seq_putc(sf, '\n');
+    }
+}
+
+static int _proc_release_callback(struct inode *inode, struct file *file)
+{
+    _snap_put(((struct seq_file *)file->private_data)->private);
+    
+    return single_release(inode, file);
+}
+
+// Parse "<pid> [follow] [budget=<cpu_use>] [rate=<percent>] [action=notify|throttle|kill]
+//  [metrics=rss,faults,io]" into the item
+static int _parse_registration(char *input, struct proc_item *item)
+{
+    char *token;
+    
+    // The first token is the PID
+    token = strsep(&input, " \t\n");
+    if (token == NULL || kstrtoint(token, 0, &item->pid) || item->pid <= 0 || item->pid >= PID_MAX_LIMIT)
+    {
+        return -EINVAL;
+    }
+    
+    // The rest are options
+    while ((token = strsep(&input, " \t\n")) != NULL)
+    {
+        if (*token == '\0')
+        {
+            continue;
+        }
+        
+        if (strcmp(token, "follow") == 0)
+        {
+            // Forks cannot be seen without the hook
+            if (fork_tracepoint == NULL)
+            {
+                return -EOPNOTSUPP;
+            }
+            item->flags |= PROC_FOLLOW_FORKS;
+        }
+        else if (strncmp(token, "budget=", 7) == 0)
+        {
+            if (kstrtoul(token + 7, 0, &item->budget))
+            {
+                return -EINVAL;
+            }
+        }
+        else if (strncmp(token, "metrics=", 8) == 0)
+        {
+            if (_parse_metrics(token + 8, &item->flags))
+            {
+                return -EINVAL;
+            }
+        }
+        else if (strncmp(token, "rate=", 5) == 0)
+        {
+            if (kstrtouint(token + 5, 0, &item->rate) || item->rate > 100)
+            {
+                return -EINVAL;
+            }
+        }
+        else if (strcmp(token, "action=notify") == 0)
+        {
+            item->action = ACTION_NOTIFY;
+        }
+        else if (strcmp(token, "action=throttle") == 0)
+        {
+            item->action = ACTION_THROTTLE;
+        }
+        else if (strcmp(token, "action=kill") == 0)
+        {
+            item->action = ACTION_KILL;
+        }
+        else
+        {
+            return -EINVAL;
+        }
+    }
+    
+    return 0;
+}
+
+// Parse a comma separated list of extra metrics to sample
+static int _parse_metrics(char *list, unsigned int *flags)
+{
+    char *name;
+    
+    while ((name = strsep(&list, ",")) != NULL)
+    {
+        if (strcmp(name, "rss") == 0)
+        {
+            *flags |= PROC_METRIC_RSS;
+        }
+        else if (strcmp(name, "faults") == 0)
+        {
+            *flags |= PROC_METRIC_FAULTS;
+        }
+#ifdef HAVE_IO_ACCOUNTING
+        else if (strcmp(name, "io") == 0)
+        {
+            *flags |= PROC_METRIC_IO;
+        }
+#endif
+        else
+        {
+            return -EINVAL;
+        }
+    }
+    
+    return 0;
+}
+
+// Parse a registration and add it to the registry's table
+static int _register(struct proc_registry *reg, char *input)
+{
+    struct proc_item new = { 0 };
+    struct pid *task;
+    int ret;
+    
+    // Initialize the item for the input PID
+    ret = _parse_registration(input, &new);
+    if (ret)
+    {
+        return ret;
+    }
+    
+    // Hold on to the PID so the sweep does not have to look it up,
+    //  a PID that does not exist is dropped by the next sweep
+    task = find_get_pid(new.pid);
+    
+    // Only the writer's own processes may be stopped or killed
+    ret = _check_owner(&new, task);
+    if (ret)
+    {
+        put_pid(task);
+        return ret;
+    }
+    
+    // Register the new item to the table,
+    //  grow it again if forks took the room meanwhile
+    do
+    {
+        ret = _table_reserve(reg, ACCESS_ONCE(reg->table.count) + 1);
+        if (ret)
+        {
+            break;
+        }
+        
+        spin_lock(&reg->table_lock);
+        ret = _table_insert(reg, &new, task);
+        spin_unlock(&reg->table_lock);
+    } while (ret == -ENOSPC);
+    
+    if (ret)
+    {
+        put_pid(task);
+    }
+    
+    return ret;
+}
+
+// Whether uid may send the task a signal, the test kill(2) makes,
+//  called under rcu_read_lock
+static bool _uid_may_signal(kuid_t uid, struct task_struct *task)
+{
+    const struct cred *tcred = __task_cred(task);
+    
+    return uid_eq(uid, tcred->uid) || uid_eq(uid, tcred->suid);
+}
+
+// Record the writer as the owner of the item, the throttle and kill actions
+//  need a writer that could signal the process itself
+static int _check_owner(struct proc_item *item, struct pid *task)
+{
+    const struct cred *cred = current_cred();
+    struct task_struct *target;
+    bool may_signal = false;
+    
+    item->owner = cred->euid;
+    if (item->action == ACTION_NOTIFY)
+    {
+        return 0;
+    }
+    
+    rcu_read_lock();
+    target = pid_task(task, PIDTYPE_PID);
+    if (target != NULL)
+    {
+        if (_uid_may_signal(cred->euid, target))
+        {
+            may_signal = true;
+        }
+        else if (_uid_may_signal(cred->uid, target))
+        {
+            item->owner = cred->uid;
+            may_signal = true;
+        }
+    }
+    rcu_read_unlock();
+    
+    if (target == NULL)
+    {
+        return -ESRCH;
+    }
+    
+    if (!may_signal)
+    {
+        if (!capable(CAP_KILL))
+        {
+            return -EPERM;
+        }
+        item->flags |= PROC_CAP_KILL;
+    }
+    
+    return 0;
+}
+
+// Write the 'status' entry
+static ssize_t _proc_write_callback(struct file *file, const char __user *buffer, size_t count, loff_t *data)
+{
+    char *input;
+    int ret;
+    
+    // Restrict the input, leave room for the terminating NUL
+    if (count > PROCFS_MAX_SIZE - 1)
+    {
+        count = PROCFS_MAX_SIZE - 1;
+    }
+    
+    // Get input (PID and options) from user space, writers may run
+    //  concurrently and parsing modifies the buffer, so each gets its own
+    input = (char *)kmalloc(count + 1, GFP_KERNEL);
+    if (input == NULL)
+    {
+        return -ENOMEM;
+    }
+    if (copy_from_user(input, buffer, count))
+    {
+        kfree(input);
+        return -EFAULT;
+    }
+    input[count] = '\0';
+    
+    ret = _register(global_registry, input);
+    kfree(input);
+    if (ret)
+    {
+        return ret;
+    }
+    
+    return count;
+}
+
+/* Table storage */
+
+static int _table_alloc(struct proc_table *t, unsigned int capacity)
+{
+    size_t size = 0;
+    char *cursor;
+    
+    // Keep every column 8-byte aligned inside the block
+    #define TABLE_SIZE(type, name) size += ALIGN(capacity * sizeof(type), sizeof(u64));
+    TABLE_COLUMNS(TABLE_SIZE)
+    #undef TABLE_SIZE
+    
+    t->index_bits = order_base_2(2 * capacity);
+    size += (1U << t->index_bits) * sizeof(unsigned int);
+    
+    t->block = vzalloc(size);
+    if (t->block == NULL)
+    {
+        return -ENOMEM;
+    }
+    
+    cursor = t->block;
+    #define TABLE_CARVE(type, name) t->name = (type *)cursor; cursor += ALIGN(capacity * sizeof(type), sizeof(u64));
+    TABLE_COLUMNS(TABLE_CARVE)
+    #undef TABLE_CARVE
+    t->index = (unsigned int *)cursor;
+    
+    t->count = 0;
+    t->capacity = capacity;
+    
+    return 0;
+}
+
+// Move n rows, the ranges may overlap
+static void _table_copy(struct proc_table *dst, unsigned int to, struct proc_table *src, unsigned int from, unsigned int n)
+{
+    #define TABLE_MOVE(type, name) memmove(&dst->name[to], &src->name[from], n * sizeof(type));
+    TABLE_COLUMNS(TABLE_MOVE)
+    #undef TABLE_MOVE
+}
+
+// Zero every column of one row
+static void _table_clear(struct proc_registry *reg, unsigned int row)
+{
+    #define TABLE_ZERO(type, name) memset(&reg->table.name[row], 0, sizeof(type));
+    TABLE_COLUMNS(TABLE_ZERO)
+    #undef TABLE_ZERO
+}
+
+// Grow the table to hold at least want rows, must be called without table_lock
+static int _table_reserve(struct proc_registry *reg, unsigned int want)
+{
+    struct proc_table bigger;
+    void *old;
+    
+    if (ACCESS_ONCE(reg->table.capacity) >= want)
+    {
+        return 0;
+    }
+    
+    if (_table_alloc(&bigger, max3(want, 2 * ACCESS_ONCE(reg->table.capacity), (unsigned int)TABLE_MIN_CAPACITY)))
+    {
+        return -ENOMEM;
+    }
+    
+    spin_lock(&reg->table_lock);
+    
+    // Somebody else may have grown it meanwhile
+    if (reg->table.capacity >= want)
+    {
+        spin_unlock(&reg->table_lock);
+        vfree(bigger.block);
+        return 0;
+    }
+    
+    _table_copy(&bigger, 0, &reg->table, 0, reg->table.count);
+    bigger.count = reg->table.count;
+    _table_reindex(&bigger);
+    old = reg->table.block;
+    reg->table = bigger;
+    
+    spin_unlock(&reg->table_lock);
+    
+    vfree(old);
+    return 0;
+}
+
+// Returns the row of pid if found
+static unsigned int _table_find(struct proc_registry *reg, int pid, bool *found)
+{
+    unsigned int mask = (1U << reg->table.index_bits) - 1;
+    unsigned int h = hash_32(pid, reg->table.index_bits);
+    unsigned int entry;
+    
+    while ((entry = reg->table.index[h]) != 0)
+    {
+        if (reg->table.pid[entry - 1] == pid)
+        {
+            *found = true;
+            return entry - 1;
+        }
+        h = (h + 1) & mask;
+    }
+    
+    *found = false;
+    return reg->table.count;
+}
+
+// Add a row to the index, the PID must not be indexed yet
+static void _table_index(struct proc_table *t, unsigned int row)
+{
+    unsigned int mask = (1U << t->index_bits) - 1;
+    unsigned int h = hash_32(t->pid[row], t->index_bits);
+    
+    while (t->index[h] != 0)
+    {
+        h = (h + 1) & mask;
+    }
+    t->index[h] = row + 1;
+}
+
+// Index every row again after rows were moved or dropped
+static void _table_reindex(struct proc_table *t)
+{
+    unsigned int row;
+    
+    memset(t->index, 0, (1U << t->index_bits) * sizeof(unsigned int));
+    for (row = 0; row < t->count; row++)
+    {
+        _table_index(t, row);
+    }
+}
+
+// Add a row for item, or update its options if the PID is registered already,
+//  called with table_lock held. Takes over the reference to task on success.
+static int _table_insert(struct proc_registry *reg, struct proc_item *item, struct pid *task)
+{
+    unsigned int slot, *flags;
+    bool found, stopped;
+    u64 ns, unmerged;
+    
+    slot = _table_find(reg, item->pid, &found);
+    
+    if (found && (reg->table.flags[slot] & PROC_FOLLOW_FORKS))
+    {
+        atomic_dec(&follow_count);
+    }
+    
+    if (found && (task == NULL || reg->table.task[slot] == task))
+    {
+        // Registering again changes the options, and the new limits are checked
+        //  from scratch. A process stopped under the old ones is resumed
+        //  unless it is still over the new budget.
+        flags = &reg->table.flags[slot];
+        stopped = *flags & PROC_STOPPED;
+        *flags = (*flags & ~(PROC_INHERITED_FLAGS | PROC_BUDGET_HIT | PROC_RATE_HIT | PROC_STOPPED)) | item->flags;
+        if (stopped)
+        {
+            if (item->action == ACTION_THROTTLE && item->budget && reg->table.cpu_use[slot] >= item->budget)
+            {
+                *flags |= PROC_BUDGET_HIT | PROC_STOPPED;
+            }
+            else
+            {
+                kill_pid(reg->table.task[slot], SIGCONT, 1);
+            }
+        }
+        put_pid(task);
+    }
+    else
+    {
+        if (found)
+        {
+            // The registered process died and a new one got its PID before the sweep
+            //  dropped the row, report the old one gone and start the row over
+            if (switch_pids != NULL)
+            {
+                reg->table.cpu_use[slot] = (unsigned long)nsecs_to_cputime(reg->table.oncpu_ns[slot]);
+            }
+            _post_event(reg, reg->table.pid[slot], EVENT_EXIT, reg->table.cpu_use[slot]);
+            _bury(reg, reg->table.pid[slot]);
+            put_pid(reg->table.task[slot]);
+        }
+        else if (reg->table.count == reg->table.capacity)
+        {
+            return -ENOSPC;
+        }
+        else
+        {
+            // Append, the sweep keeps the rows packed
+            slot = reg->table.count++;
+        }
+        
+        _table_clear(reg, slot);
+        reg->table.pid[slot] = item->pid;
+        reg->table.task[slot] = task;
+        reg->table.stamp[slot] = jiffies;
+        reg->table.flags[slot] = item->flags;
+        reg->table.changed_gen[slot] = reg->sweep_gen + 1;
+        reg->table.parent[slot] = item->parent;
+        if (!found)
+        {
+            _table_index(&reg->table, slot);
+        }
+        
+        // Start counting context switches of the new process. If another
+        //  registry tracks it already, the next merge adds the time still in
+        //  the per-CPU slots to this row too, leave it out of the seed
+        if (switch_pids != NULL)
+        {
+            ns = _oncpu_seed(task);
+            if (test_and_set_bit(item->pid, switch_pids))
+            {
+                unmerged = _oncpu_unmerged(item->pid);
+                ns = ns > unmerged ? ns - unmerged : 0;
+            }
+            reg->table.oncpu_ns[slot] = ns;
+        }
+    }
+    
+    reg->table.budget[slot] = item->budget;
+    reg->table.rate[slot] = item->rate;
+    reg->table.action[slot] = item->action;
+    reg->table.owner[slot] = item->owner;
+    
+    if (item->flags & PROC_FOLLOW_FORKS)
+    {
+        atomic_inc(&follow_count);
+    }
+    
+    return 0;
+}
+
+/* Fork following */
+
+// Called in the parent's context for every fork/clone in the system,
+//  registers the child in every registry where the parent is registered with "follow"
+static void _fork_probe(void *data, struct task_struct *parent, struct task_struct *child)
+{
+    struct proc_registry *reg;
+    struct proc_pending *pending;
+    struct proc_item new;
+    struct pid *task;
+    unsigned int slot;
+    bool found;
+    
+    // Fast path: nobody asked to follow forks, or a thread is being created
+    if (atomic_read(&follow_count) == 0 || !thread_group_leader(child))
+    {
+        return;
+    }
+    
+    spin_lock(&registries_lock);
+    
+    list_for_each_entry(reg, &registries, list)
+    {
+        spin_lock(&reg->table_lock);
+        
+        // The child inherits the flags and limits, so its own children are followed too,
+        //  the parent may itself still be waiting for room
+        memset(&new, 0, sizeof(new));
+        slot = _table_find(reg, parent->tgid, &found);
+        if (found && (reg->table.flags[slot] & PROC_FOLLOW_FORKS))
+        {
+            new.parent = reg->table.pid[slot];
+            new.flags = reg->table.flags[slot] & PROC_INHERITED_FLAGS;
+            new.budget = reg->table.budget[slot];
+            new.rate = reg->table.rate[slot];
+            new.action = reg->table.action[slot];
+            new.owner = reg->table.owner[slot];
+        }
+        else if (!found && (pending = _pending_find(reg, parent->tgid)) != NULL)
+        {
+            new = pending->item;
+            new.parent = pending->item.pid;
+        }
+        
+        if (new.parent == 0)
+        {
+            spin_unlock(&reg->table_lock);
+            continue;
+        }
+        new.pid = child->pid;
+        task = get_pid(task_pid(child));
+        
+        // Tracepoint probes cannot sleep, so the table cannot grow here,
+        //  children that do not fit wait in a list until grow_work made room
+        if (_table_insert(reg, &new, task))
+        {
+            pending = (struct proc_pending *)kmalloc(sizeof(struct proc_pending), GFP_ATOMIC);
+            if (pending != NULL)
+            {
+                pending->item = new;
+                pending->task = task;
+                list_add_tail(&pending->list, &reg->pending);
+                reg->pending_count++;
+                
+                // Its own forks are followed while it waits
+                atomic_inc(&follow_count);
+            }
+            else
+            {
+                put_pid(task);
+                printk_ratelimited(KERN_WARNING "MP1 out of memory, fork of %d not followed\n", new.parent);
+            }
+        }
+        
+        // Grow ahead of a fork burst instead of waiting for the next sweep
+        if (reg->pending_count || reg->table.count > reg->table.capacity - reg->table.capacity / 4)
+        {
+            queue_work(update_workqueue, &reg->grow_work);
+        }
+        
+        spin_unlock(&reg->table_lock);
+    }
+    
+    spin_unlock(&registries_lock);
+}
+
+// Followed fork of pid waiting for room, called with table_lock held
+static struct proc_pending *_pending_find(struct proc_registry *reg, int pid)
+{
+    struct proc_pending *pending;
+    
+    list_for_each_entry(pending, &reg->pending, list)
+    {
+        if (pending->item.pid == pid)
+        {
+            return pending;
+        }
+    }
+    
+    return NULL;
+}
+
+// Grow the table by a quarter and move the waiting forks in
+static void _grow_work(struct work_struct *work)
+{
+    struct proc_registry *reg = container_of(work, struct proc_registry, grow_work);
+    struct proc_pending *pending, *next;
+    LIST_HEAD(done);
+    unsigned int want;
+    
+    // Without memory the forks keep waiting, the next sweep tries again
+    want = ACCESS_ONCE(reg->table.count) + ACCESS_ONCE(reg->pending_count);
+    if (_table_reserve(reg, want + want / 4 + TABLE_MIN_CAPACITY / 2))
+    {
+        return;
+    }
+    
+    spin_lock(&reg->table_lock);
+    
+    list_for_each_entry_safe(pending, next, &reg->pending, list)
+    {
+        if (_table_insert(reg, &pending->item, pending->task))
+        {
+            // More forks came in meanwhile, try again with a bigger table
+            queue_work(update_workqueue, &reg->grow_work);
+            break;
+        }
+        
+        // The row counts as following now
+        atomic_dec(&follow_count);
+        list_move_tail(&pending->list, &done);
+        reg->pending_count--;
+    }
+    
+    spin_unlock(&reg->table_lock);
+    
+    list_for_each_entry_safe(pending, next, &done, list)
+    {
+        kfree(pending);
+    }
+}
+
+static void _match_tracepoint(struct tracepoint *tp, void *priv)
+{
+    struct tracepoint **found = priv;
+    
+    if (strcmp(tp->name, (*found)->name) == 0)
+    {
+        *found = tp;
+    }
+}
+
+// Scheduler tracepoints are not exported to modules, look them up by name
+static struct tracepoint *_find_tracepoint(const char *name)
+{
+    struct tracepoint key = { .name = name };
+    struct tracepoint *found = &key;
+    
+    for_each_kernel_tracepoint(_match_tracepoint, &found);
+    
+    return found == &key ? NULL : found;
+}
+
+/* Exact accounting */
+
+static unsigned int _burst_bucket(u64 ns)
+{
+    unsigned int bucket = 0;
+    
+    for (ns >>= 12; ns && bucket < BURST_BUCKETS - 1; ns >>= 2)
+    {
+        bucket++;
+    }
+    
+    return bucket;
+}
+
+// Add on-CPU time of the process on sc to its slot, and count a finished burst
+//  in the bucket unless it is BURST_BUCKETS. Called with sc->lock held.
+static void _switch_charge(struct switch_cpu *sc, u64 ns, unsigned int bucket)
+{
+    struct switch_slot *slot;
+    unsigned int hash, i;
+    
+    hash = hash_32(sc->pid, SWITCH_SLOT_BITS);
+    
+    for (i = 0; i < SWITCH_SLOTS; i++)
+    {
+        slot = &sc->slots[(hash + i) % SWITCH_SLOTS];
+        if (slot->pid == sc->pid || slot->pid == 0)
+        {
+            slot->pid = sc->pid;
+            slot->ns += ns;
+            if (bucket < BURST_BUCKETS)
+            {
+                slot->hist[bucket]++;
+            }
+            return;
+        }
+    }
+    
+    sc->lost_ns += ns;
+}
+
+// Called by the scheduler on every context switch with interrupts off,
+//  must not sleep or take any lock the scheduler may hold
+static void _switch_probe(SWITCH_PROBE_ARGS)
+{
+    struct switch_cpu *sc = this_cpu_ptr(switch_cpus);
+    u64 now;
+    
+    // Fast path: neither side is registered
+    if (sc->pid == 0 && !test_bit(next->tgid, switch_pids))
+    {
+        return;
+    }
+    
+    now = local_clock();
+    
+    raw_spin_lock(&sc->lock);
+    
+    // Charge the burst that just ended, a merge may have charged part of it
+    if (sc->pid != 0)
+    {
+        _switch_charge(sc, now > sc->since ? now - sc->since : 0, _burst_bucket(now - sc->started));
+    }
+    
+    // Start the next one
+    if (test_bit(next->tgid, switch_pids))
+    {
+        sc->pid = next->tgid;
+        sc->started = now;
+        sc->since = now;
+    }
+    else
+    {
+        sc->pid = 0;
+    }
+    
+    raw_spin_unlock(&sc->lock);
+}
+
+// Fold every CPU's slots into the tables of all registries,
+//  called without any table_lock held. The slots are taken out under the
+//  per-CPU lock first, which is only ever taken innermost since the sweep
+//  posts events and sends signals under table_lock.
+static void _switch_merge(void)
+{
+    struct proc_registry *reg;
+    struct switch_cpu *sc;
+    struct switch_slot *merged, *slot;
+    unsigned long flags;
+    unsigned int row, i, b, n;
+    u64 lost_ns = 0, now;
+    bool found;
+    int cpu;
+    
+    merged = (struct switch_slot *)kmalloc(SWITCH_SLOTS * sizeof(struct switch_slot), GFP_KERNEL);
+    if (merged == NULL)
+    {
+        // The slots keep filling up until the next sweep
+        return;
+    }
+    
+    for_each_possible_cpu(cpu)
+    {
+        sc = per_cpu_ptr(switch_cpus, cpu);
+        
+        raw_spin_lock_irqsave(&sc->lock, flags);
+        
+        // Charge the burst still running too, a process that rarely
+        //  switches out would not be accounted for otherwise
+        if (sc->pid != 0)
+        {
+            now = cpu_clock(cpu);
+            if (now > sc->since)
+            {
+                _switch_charge(sc, now - sc->since, BURST_BUCKETS);
+                sc->since = now;
+            }
+        }
+        
+        for (i = 0, n = 0; i < SWITCH_SLOTS; i++)
+        {
+            if (sc->slots[i].pid != 0)
+            {
+                merged[n++] = sc->slots[i];
+            }
+        }
+        memset(sc->slots, 0, sizeof(sc->slots));
+        lost_ns += sc->lost_ns;
+        sc->lost_ns = 0;
+        
+        raw_spin_unlock_irqrestore(&sc->lock, flags);
+        
+        if (n == 0)
+        {
+            continue;
+        }
+        
+        // A process may be registered in several registries
+        spin_lock(&registries_lock);
+        list_for_each_entry(reg, &registries, list)
+        {
+            spin_lock(&reg->table_lock);
+            
+            for (i = 0; i < n; i++)
+            {
+                slot = &merged[i];
+                
+                // The row is gone if the process was dropped since it ran
+                row = _table_find(reg, slot->pid, &found);
+                if (found)
+                {
+                    reg->table.oncpu_ns[row] += slot->ns;
+                    for (b = 0; b < BURST_BUCKETS; b++)
+                    {
+                        reg->table.hist[row][b] += slot->hist[b];
+                    }
+                }
+            }
+            
+            spin_unlock(&reg->table_lock);
+        }
+        spin_unlock(&registries_lock);
+    }
+    
+    kfree(merged);
+    
+    if (lost_ns)
+    {
+        printk_ratelimited(KERN_WARNING "MP1 per-CPU slots full, %llu ns not accounted\n", lost_ns);
+    }
+}
+
+// On-CPU time a process has used before it was registered
+static u64 _oncpu_seed(struct pid *task)
+{
+    struct task_struct *leader, *thread;
+    u64 ns = 0;
+    
+    rcu_read_lock();
+    leader = pid_task(task, PIDTYPE_PID);
+    if (leader != NULL)
+    {
+        ns = leader->signal->sum_sched_runtime;
+        for_each_thread(leader, thread)
+        {
+            ns += thread->se.sum_exec_runtime;
+        }
+    }
+    rcu_read_unlock();
+    
+    return ns;
+}
+
+// On-CPU time of a process charged to the per-CPU slots but not merged yet,
+//  including the bursts still running
+static u64 _oncpu_unmerged(int pid)
+{
+    struct switch_cpu *sc;
+    struct switch_slot *slot;
+    unsigned long flags;
+    unsigned int hash, i;
+    u64 ns = 0, now;
+    int cpu;
+    
+    hash = hash_32(pid, SWITCH_SLOT_BITS);
+    
+    for_each_possible_cpu(cpu)
+    {
+        sc = per_cpu_ptr(switch_cpus, cpu);
+        
+        raw_spin_lock_irqsave(&sc->lock, flags);
+        
+        if (sc->pid == pid)
+        {
+            now = cpu_clock(cpu);
+            if (now > sc->since)
+            {
+                ns += now - sc->since;
+            }
+        }
+        
+        // Same probing as _switch_charge, a free slot ends the chain
+        for (i = 0; i < SWITCH_SLOTS; i++)
+        {
+            slot = &sc->slots[(hash + i) % SWITCH_SLOTS];
+            if (slot->pid == pid)
+            {
+                ns += slot->ns;
+                break;
+            }
+            if (slot->pid == 0)
+            {
+                break;
+            }
+        }
+        
+        raw_spin_unlock_irqrestore(&sc->lock, flags);
+    }
+    
+    return ns;
+}
+
+/* Scheduling latency */
+
+// Record the run-queue wait of one sampling period, called with table_lock held
+static void _sample_wait(struct proc_registry *reg, unsigned int row, struct task_struct *task)
+{
+#ifdef HAVE_SCHED_INFO
+    struct task_struct *thread;
+    u64 run_delay = 0;
+    unsigned long pcount = 0;
+    
+    // Sum over the threads, the process waits whenever any of them does
+    for_each_thread(task, thread)
+    {
+        run_delay += thread->sched_info.run_delay;
+        pcount += thread->sched_info.pcount;
+    }
+    
+    // The first sample has nothing to take a difference from,
+    //  threads that exit take their share of either total with them
+    if ((reg->table.flags[row] & PROC_SAMPLED) && run_delay >= reg->table.run_delay[row]
+        && pcount >= reg->table.pcount[row])
+    {
+        reg->table.waits[row][reg->table.wait_count[row] % WAIT_WINDOW] = (u32)min_t(u64, (run_delay - reg->table.run_delay[row]) / NSEC_PER_USEC, U32_MAX);
+        reg->table.wait_count[row]++;
+        reg->table.slices[row] = pcount - reg->table.pcount[row];
+    }
+    
+    reg->table.run_delay[row] = run_delay;
+    reg->table.pcount[row] = pcount;
+#endif
+}
+
+// Fill the latest period and the percentiles of the window into the snapshot
+static void _wait_percentiles(struct proc_registry *reg, unsigned int row, struct snap_entry *entry)
+{
+    wait_window_t sorted;
+    unsigned int n, i, j;
+    u32 value;
+    
+    n = min_t(unsigned int, reg->table.wait_count[row], WAIT_WINDOW);
+    if (n == 0)
+    {
+        return;
+    }
+    
+    entry->wait_us = reg->table.waits[row][(reg->table.wait_count[row] - 1) % WAIT_WINDOW];
+    entry->slices = reg->table.slices[row];
+    
+    // Insertion sort, the window is tiny
+    for (i = 0; i < n; i++)
+    {
+        value = reg->table.waits[row][i];
+        for (j = i; j > 0 && sorted[j - 1] > value; j--)
+        {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = value;
+    }
+    
+    entry->wait_p50 = sorted[(n - 1) * 50 / 100];
+    entry->wait_p90 = sorted[(n - 1) * 90 / 100];
+    entry->wait_max = sorted[n - 1];
+}
+
+/* Memory, fault and I/O metrics */
+
+// Sample the metrics selected for the row, called under rcu_read_lock with table_lock held
+static void _sample_metrics(struct proc_registry *reg, unsigned int row, struct task_struct *task)
+{
+    unsigned int flags = reg->table.flags[row];
+    struct task_struct *thread;
+    unsigned long min_flt, maj_flt;
+#ifdef HAVE_IO_ACCOUNTING
+    u64 read_bytes, write_bytes;
+#endif
+    
+    // Rows without extra metrics cost a single test
+    if (!(flags & PROC_METRICS))
+    {
+        return;
+    }
+    
+    // task->mm is cleared under task_lock on exit, so it cannot go away here
+    if (flags & PROC_METRIC_RSS)
+    {
+        task_lock(task);
+        reg->table.rss[row] = task->mm != NULL ? get_mm_rss(task->mm) : 0;
+        task_unlock(task);
+    }
+    
+    // Counters of exited threads are kept in the signal struct
+    if (flags & PROC_METRIC_FAULTS)
+    {
+        min_flt = task->signal->min_flt;
+        maj_flt = task->signal->maj_flt;
+        for_each_thread(task, thread)
+        {
+            min_flt += thread->min_flt;
+            maj_flt += thread->maj_flt;
+        }
+        reg->table.min_flt[row] = min_flt;
+        reg->table.maj_flt[row] = maj_flt;
+    }
+    
+#ifdef HAVE_IO_ACCOUNTING
+    if (flags & PROC_METRIC_IO)
+    {
+        read_bytes = task->signal->ioac.read_bytes;
+        write_bytes = task->signal->ioac.write_bytes;
+        for_each_thread(task, thread)
+        {
+            read_bytes += thread->ioac.read_bytes;
+            write_bytes += thread->ioac.write_bytes;
+        }
+        reg->table.read_bytes[row] = read_bytes;
+        reg->table.write_bytes[row] = write_bytes;
+    }
+#endif
+}
+
+/* CPU limit notifications */
+
+// Queue a notification for readers of the registry's events
+static void _post_event(struct proc_registry *reg, int pid, enum proc_event_type type, unsigned long value)
+{
+    struct proc_events *ev = &reg->events;
+    struct proc_event *event;
+    
+    spin_lock(&ev->lock);
+    
+    // Drop the oldest event if nobody has been reading
+    if (ev->head - ev->tail == EVENT_RING_SIZE)
+    {
+        ev->tail++;
+        ev->lost++;
+    }
+    
+    event = &ev->ring[ev->head % EVENT_RING_SIZE];
+    event->pid = pid;
+    event->type = type;
+    event->value = value;
+    ev->head++;
+    
+    spin_unlock(&ev->lock);
+    
+    wake_up_interruptible(&ev->wait);
+}
+
+// Compare a fresh sample against the row's budget and rate limit,
+//  notify and act only when a limit is crossed. elapsed is the time in jiffies
+//  since the previous sample.
+static void _check_limits(struct proc_registry *reg, unsigned int slot, struct task_struct *task, unsigned long last_cpu_use, unsigned long elapsed)
+{
+    unsigned long cpu_use = reg->table.cpu_use[slot];
+    unsigned int *flags = &reg->table.flags[slot];
+    unsigned long rate_limit;
+    int signal = 0;
+    
+    if (reg->table.budget[slot] && cpu_use >= reg->table.budget[slot] && !(*flags & PROC_BUDGET_HIT))
+    {
+        *flags |= PROC_BUDGET_HIT;
+        _post_event(reg, reg->table.pid[slot], EVENT_BUDGET, cpu_use);
+        
+        // A throttled process over its budget stays stopped
+        if (reg->table.action[slot] == ACTION_THROTTLE)
+        {
+            signal = SIGSTOP;
+        }
+        else if (reg->table.action[slot] == ACTION_KILL)
+        {
+            signal = SIGKILL;
+        }
+    }
+    
+    // The first sample has no previous one to take a rate from
+    if (reg->table.rate[slot] && (*flags & PROC_SAMPLED))
+    {
+        rate_limit = (unsigned long)jiffies_to_cputime(elapsed) * reg->table.rate[slot] / 100;
+        
+        if (cpu_use - last_cpu_use > rate_limit && !(*flags & PROC_RATE_HIT))
+        {
+            *flags |= PROC_RATE_HIT;
+            _post_event(reg, reg->table.pid[slot], EVENT_RATE, cpu_use - last_cpu_use);
+            
+            if (reg->table.action[slot] == ACTION_THROTTLE)
+            {
+                signal = SIGSTOP;
+            }
+            else if (reg->table.action[slot] == ACTION_KILL)
+            {
+                signal = SIGKILL;
+            }
+        }
+        else if (cpu_use - last_cpu_use <= rate_limit && (*flags & PROC_RATE_HIT))
+        {
+            *flags &= ~PROC_RATE_HIT;
+            _post_event(reg, reg->table.pid[slot], EVENT_RATE_CLEAR, cpu_use - last_cpu_use);
+            
+            // A stopped process uses no CPU, so it comes back here after one period
+            if ((*flags & PROC_STOPPED) && !(*flags & PROC_BUDGET_HIT))
+            {
+                signal = SIGCONT;
+            }
+        }
+    }
+    
+    *flags |= PROC_SAMPLED;
+    
+    // The process may have switched credentials since it was registered,
+    //  resuming it only undoes our own stop
+    if ((signal == SIGSTOP || signal == SIGKILL) && !(*flags & PROC_CAP_KILL)
+        && !_uid_may_signal(reg->table.owner[slot], task))
+    {
+        printk_ratelimited(KERN_WARNING "MP1 owner of %d may no longer signal it, limit not enforced\n", reg->table.pid[slot]);
+        signal = 0;
+    }
+    
+    if (signal)
+    {
+        kill_pid(reg->table.task[slot], signal, 1);
+        
+        if (signal == SIGSTOP)
+        {
+            *flags |= PROC_STOPPED;
+        }
+        else if (signal == SIGCONT)
+        {
+            *flags &= ~PROC_STOPPED;
+        }
+    }
+}
+
+// Read events, one "[PID] [event] [value]" line per notification
+static ssize_t _events_read(struct proc_events *ev, struct file *file, char __user *buffer, size_t count)
+{
+    struct proc_event *event;
+    char *kbuf;
+    size_t len = 0;
+    int n, ret;
+    
+    // Block until there is something to report
+    if (file->f_flags & O_NONBLOCK)
+    {
+        if (ev->head == ev->tail && ev->lost == 0)
+        {
+            return -EAGAIN;
+        }
+    }
+    else
+    {
+        ret = wait_event_interruptible(ev->wait, ev->head != ev->tail || ev->lost != 0 || ACCESS_ONCE(unloading));
+        if (ret)
+        {
+            return ret;
+        }
+        
+        // Let the files be removed
+        if (ev->head == ev->tail && ev->lost == 0)
+        {
+            return 0;
+        }
+    }
+    
+    count = min_t(size_t, count, PAGE_SIZE);
+    kbuf = (char *)kmalloc(count, GFP_KERNEL);
+    if (kbuf == NULL)
+    {
+        return -ENOMEM;
+    }
+    
+    spin_lock(&ev->lock);
+    
+    // Report overwritten events first so readers know they missed some
+    if (ev->lost)
+    {
+        n = snprintf(kbuf, count, "0 %s %lu\n", event_names[EVENT_LOST], ev->lost);
+        if (n < count)
+        {
+            len = n;
+            ev->lost = 0;
+        }
+    }
+    
+    // Only hand out whole lines
+    while (ev->head != ev->tail)
+    {
+        event = &ev->ring[ev->tail % EVENT_RING_SIZE];
+        n = snprintf(kbuf + len, count - len, "%d %s %lu\n", event->pid, event_names[event->type], event->value);
+        if (n >= count - len)
+        {
+            break;
+        }
+        len += n;
+        ev->tail++;
+    }
+    
+    spin_unlock(&ev->lock);
+    
+    if (len == 0)
+    {
+        kfree(kbuf);
+        return -EINVAL;
+    }
+    
+    if (copy_to_user(buffer, kbuf, len))
+    {
+        kfree(kbuf);
+        return -EFAULT;
+    }
+    
+    kfree(kbuf);
+    return len;
+}
+
+static unsigned int _events_poll(struct proc_events *ev, struct file *file, poll_table *wait)
+{
+    poll_wait(file, &ev->wait, wait);
+    
+    if (ev->head != ev->tail || ev->lost != 0)
+    {
+        return POLLIN | POLLRDNORM;
+    }
+    if (ACCESS_ONCE(unloading))
+    {
+        return POLLHUP;
+    }
+    
+    return 0;
+}
+
+// Read the 'events' entry, the events of the global registry
+static ssize_t _events_read_callback(struct file *file, char __user *buffer, size_t count, loff_t *data)
+{
+    return _events_read(&global_registry->events, file, buffer, count);
+}
+
+static unsigned int _events_poll_callback(struct file *file, poll_table *wait)
+{
+    return _events_poll(&global_registry->events, file, wait);
+}
+
+static const struct file_operations events_proc_fops = {
+    .owner = THIS_MODULE,
+    .read = _events_read_callback,
+    .poll = _events_poll_callback,
+    .llseek = no_llseek,
+};
+
+/* Sweep snapshots */
+
+// Room for count entries and as many remembered removals
+static struct proc_snapshot *_snap_alloc(unsigned int count, unsigned int tombs)
+{
+    struct proc_snapshot *snap;
+    size_t size = sizeof(struct proc_snapshot)
+        + count * sizeof(struct snap_entry)
+        + tombs * sizeof(struct proc_tomb);
+    
+    // Large registries do not fit in contiguous pages
+    if (size <= PAGE_SIZE)
+    {
+        snap = (struct proc_snapshot *)kzalloc(size, GFP_KERNEL);
+    }
+    else
+    {
+        snap = (struct proc_snapshot *)vzalloc(size);
+    }
+    
+    if (snap == NULL)
+    {
+        return NULL;
+    }
+    
+    kref_init(&snap->ref);
+    snap->tombs = (struct proc_tomb *)&snap->entries[count];
+    
+    return snap;
+}
+
+static int _snap_entry_cmp(const void *a, const void *b)
+{
+    int pid_a = ((const struct snap_entry *)a)->pid;
+    int pid_b = ((const struct snap_entry *)b)->pid;
+    
+    return pid_a < pid_b ? -1 : pid_a > pid_b;
+}
+
+static void _snap_release(struct kref *ref)
+{
+    kvfree(container_of(ref, struct proc_snapshot, ref));
+}
+
+// Take a reference to the latest snapshot
+static struct proc_snapshot *_snap_get(struct proc_registry *reg)
+{
+    struct proc_snapshot *snap;
+    
+    spin_lock(&reg->snap_lock);
+    snap = reg->current_snap;
+    kref_get(&snap->ref);
+    spin_unlock(&reg->snap_lock);
+    
+    return snap;
+}
+
+static void _snap_put(struct proc_snapshot *snap)
+{
+    kref_put(&snap->ref, _snap_release);
+}
+
+// Replace the latest snapshot, readers of the old one keep it until they close
+static void _snap_publish(struct proc_registry *reg, struct proc_snapshot *snap)
+{
+    struct proc_snapshot *old;
+    
+    spin_lock(&reg->snap_lock);
+    old = reg->current_snap;
+    reg->current_snap = snap;
+    spin_unlock(&reg->snap_lock);
+    
+    _snap_put(old);
+}
+
+/* Incremental export
+ *
+ * A client writes the generation it last saw (0 for none) as decimal text to
+ * 'export', then reads from offset 0. The read returns only the entries that
+ * changed since that generation, as of the latest sweep at the time of the
+ * write (or of the open if nothing was written):
+ *
+ *   header
+ *     u8[4]   magic "MP1D"
+ *     u8      version, 1
+ *     u8      flags, bit 0 set if this is a full dump and the client
+ *             must drop every entry not listed
+ *     varint  generation to send with the next request
+ *     varint  number of records
+ *   record, removals before updates
+ *     varint  zigzag(pid - pid of the previous record), the first record
+ *             is relative to 0
+ *     u8      kind, 0 update, 1 removed
+ *     varint  cpu_use, update only
+ *     varint  parent PID or 0, update only
+ *
+ * varint is unsigned LEB128, 7 bits per byte, least significant group first.
+ * zigzag(n) is (n << 1) ^ (n >> 31). A full dump is sent when the requested
+ * generation is 0, newer than the current one, or older than the oldest
+ * removal still remembered.
+ */
+
+#define EXPORT_VERSION 1
+#define EXPORT_FULL 0x1
+#define EXPORT_UPDATE 0
+#define EXPORT_REMOVED 1
+
+// Remember a removed PID for incremental clients, called with table_lock held
+static void _bury(struct proc_registry *reg, int pid)
+{
+    struct proc_tomb *tomb;
+    
+    if (reg->tomb_ring == NULL)
+    {
+        return;
+    }
+    tomb = &reg->tomb_ring[reg->tomb_head % TOMB_RING_SIZE];
+    
+    // Clients older than an overwritten tombstone need a full dump
+    if (reg->tomb_head >= TOMB_RING_SIZE)
+    {
+        reg->tomb_floor = max(reg->tomb_floor, tomb->gen);
+    }
+    
+    tomb->pid = pid;
+    tomb->gen = reg->sweep_gen;
+    reg->tomb_head++;
+}
+
+static void _put_varint(struct seq_file *sf, u64 value)
+{
+    u8 buf[10];
+    int len = 0;
+    
+    do
+    {
+        buf[len] = value & 0x7f;
+        value >>= 7;
+        if (value)
+        {
+            buf[len] |= 0x80;
+        }
+        len++;
+    } while (value);
+    
+    seq_write(sf, buf, len);
+}
+
+static void _put_pid_delta(struct seq_file *sf, int pid, int *prev)
+{
+    s32 delta = pid - *prev;
+    
+    _put_varint(sf, (u32)((delta << 1) ^ (delta >> 31)));
+    *prev = pid;
+}
+
+static int _export_show_callback(struct seq_file *sf, void *v)
+{
+    struct export_request *req = sf->private;
+    struct proc_snapshot *snap = req->snap;
+    struct snap_entry *cur;
+    struct proc_tomb *tomb;
+    unsigned int i;
+    u64 since;
+    u8 flags = 0, kind;
+    u32 records = 0;
+    int prev = 0;
+    
+    since = req->since;
+    if (since == 0 || since > snap->gen || since < snap->tomb_floor)
+    {
+        flags |= EXPORT_FULL;
+        since = 0;
+    }
+    
+    // Count first, the header carries the number of records
+    for (i = 0; i < snap->count; i++)
+    {
+        if (snap->entries[i].changed_gen > since)
+        {
+            records++;
+        }
+    }
+    for (i = 0; !(flags & EXPORT_FULL) && i < snap->tomb_count; i++)
+    {
+        if (snap->tombs[i].gen > since)
+        {
+            records++;
+        }
+    }
+    
+    seq_write(sf, "MP1D", 4);
+    seq_putc(sf, EXPORT_VERSION);
+    seq_putc(sf, flags);
+    _put_varint(sf, snap->gen);
+    _put_varint(sf, records);
+    
+    // Removals go first, a PID may have been removed and registered again
+    for (i = 0; !(flags & EXPORT_FULL) && i < snap->tomb_count; i++)
+    {
+        tomb = &snap->tombs[i];
+        if (tomb->gen > since)
+        {
+            kind = EXPORT_REMOVED;
+            _put_pid_delta(sf, tomb->pid, &prev);
+            seq_putc(sf, kind);
+        }
+    }
+    
+    for (i = 0; i < snap->count; i++)
+    {
+        cur = &snap->entries[i];
+        if (cur->changed_gen > since)
+        {
+            kind = EXPORT_UPDATE;
+            _put_pid_delta(sf, cur->pid, &prev);
+            seq_putc(sf, kind);
+            _put_varint(sf, cur->cpu_use);
+            _put_varint(sf, cur->parent);
+        }
+    }
+    
+    return 0;
+}
+
+static int _export_open_callback(struct inode *inode, struct file *file)
+{
+    struct export_request *req;
+    int ret;
+    
+    req = (struct export_request *)kzalloc(sizeof(struct export_request), GFP_KERNEL);
+    if (req == NULL)
+    {
+        return -ENOMEM;
+    }
+    req->snap = _snap_get(global_registry);
+    
+    ret = single_open(file, _export_show_callback, req);
+    if (ret)
+    {
+        _snap_put(req->snap);
+        kfree(req);
+    }
+    
+    return ret;
+}
+
+// Write the generation the next read is relative to
+static ssize_t _export_write_callback(struct file *file, const char __user *buffer, size_t count, loff_t *data)
+{
+    struct seq_file *sf = file->private_data;
+    struct export_request *req = sf->private;
+    struct proc_snapshot *old;
+    u64 since;
+    int ret;
+    
+    ret = kstrtoull_from_user(buffer, count, 0, &since);
+    if (ret)
+    {
+        return ret;
+    }
+    
+    // A new request is answered from the latest sweep,
+    //  seq_read holds the seq_file lock while the show callback walks the old one
+    mutex_lock(&sf->lock);
+    old = req->snap;
+    req->since = since;
+    req->snap = _snap_get(global_registry);
+    mutex_unlock(&sf->lock);
+    _snap_put(old);
+    
+    return count;
+}
+
+static int _export_release_callback(struct inode *inode, struct file *file)
+{
+    struct export_request *req = ((struct seq_file *)file->private_data)->private;
+    
+    _snap_put(req->snap);
+    kfree(req);
+    
+    return single_release(inode, file);
+}
+
+static const struct file_operations export_proc_fops = {
+    .owner = THIS_MODULE,
+    .open = _export_open_callback,
+    .read = seq_read,
+    .write = _export_write_callback,
+    .llseek = seq_lseek,
+    .release = _export_release_callback,
+};
+
+/* Registry dump and restore
+ *
+ * Reading 'registry' returns every registration with its history, writing the
+ * same bytes back (e.g. right after reloading the module) re-registers the
+ * processes that are still alive in one go:
+ *
+ *   header, struct registry_header
+ *     char[4] magic "MP1R"
+ *     le32    version, 2, version 1 dumps are still accepted
+ *     le32    size of each record
+ *     le32    number of records
+ *     le64    sweep generation at the time of the dump
+ *   records, struct registry_record, in no particular order
+ *
+ * Each record carries the start time of its process, a PID that was reused
+ * while the module was out is not mistaken for the registered process.
+ * Version 1 records end before the start time, for them only processes
+ * started before the module was loaded are taken.
+ * Limit crossings are detected again by the first sweep after a restore, so
+ * their events are posted once more and throttled processes are stopped again.
+ */
+
+#define REGISTRY_VERSION 2
+#define REGISTRY_V1_RECORD offsetof(struct registry_record, start_time)
+
+static int _registry_show_callback(struct seq_file *sf, void *v)
+{
+    struct proc_registry *reg = global_registry;
+    struct registry_header header;
+    struct registry_record rec;
+    struct task_struct *task;
+    unsigned int i, b;
+    
+    spin_lock(&reg->table_lock);
+    rcu_read_lock();
+    
+    memcpy(header.magic, "MP1R", 4);
+    header.version = cpu_to_le32(REGISTRY_VERSION);
+    header.record_size = cpu_to_le32(sizeof(struct registry_record));
+    header.count = cpu_to_le32(reg->table.count);
+    header.gen = cpu_to_le64(reg->sweep_gen);
+    seq_write(sf, &header, sizeof(header));
+    
+    for (i = 0; i < reg->table.count; i++)
+    {
+        rec.pid = cpu_to_le32(reg->table.pid[i]);
+        rec.parent = cpu_to_le32(reg->table.parent[i]);
+        rec.flags = cpu_to_le32(reg->table.flags[i] & PROC_OPTION_FLAGS);
+        rec.action = cpu_to_le32(reg->table.action[i]);
+        rec.rate = cpu_to_le32(reg->table.rate[i]);
+        rec.wait_count = cpu_to_le32(reg->table.wait_count[i]);
+        rec.budget = cpu_to_le64(reg->table.budget[i]);
+        rec.cpu_use = cpu_to_le64(reg->table.cpu_use[i]);
+        rec.oncpu_ns = cpu_to_le64(reg->table.oncpu_ns[i]);
+        for (b = 0; b < BURST_BUCKETS; b++)
+        {
+            rec.hist[b] = cpu_to_le32(reg->table.hist[i][b]);
+        }
+        for (b = 0; b < WAIT_WINDOW; b++)
+        {
+            rec.waits[b] = cpu_to_le32(reg->table.waits[i][b]);
+        }
+        
+        // A process that already exited is skipped by the restore
+        task = pid_task(reg->table.task[i], PIDTYPE_PID);
+        rec.start_time = cpu_to_le64(task != NULL ? task->start_time : 0);
+        seq_write(sf, &rec, sizeof(rec));
+    }
+    
+    rcu_read_unlock();
+    spin_unlock(&reg->table_lock);
+    
+    return 0;
+}
+
+// Opened for reading to dump, for writing to restore
+static int _registry_open_callback(struct inode *inode, struct file *file)
+{
+    struct proc_registry *reg = global_registry;
+    struct restore_state *rs;
+    size_t size;
+    
+    if ((file->f_mode & FMODE_READ) && (file->f_mode & FMODE_WRITE))
+    {
+        return -EINVAL;
+    }
+    
+    if (file->f_mode & FMODE_READ)
+    {
+        // Size the buffer for the whole dump up front, with room for a few forks
+        size = sizeof(struct registry_header)
+            + (ACCESS_ONCE(reg->table.count) + TABLE_MIN_CAPACITY) * sizeof(struct registry_record);
+        return single_open_size(file, _registry_show_callback, NULL, size);
+    }
+    
+    rs = (struct restore_state *)kzalloc(sizeof(struct restore_state), GFP_KERNEL);
+    if (rs == NULL)
+    {
+        return -ENOMEM;
+    }
+    file->private_data = rs;
+    
+    return 0;
+}
+
+// Register one dumped process again if it still exists
+static void _restore_record(struct restore_state *rs)
+{
+    struct proc_registry *reg = global_registry;
+    struct registry_record rec = { 0 };
+    struct proc_item item = { 0 };
+    struct task_struct *process;
+    struct pid *task;
+    unsigned int slot, b;
+    bool found, same;
+    int ret;
+    
+    memcpy(&rec, rs->record, rs->record_size);
+    
+    item.pid = le32_to_cpu(rec.pid);
+    item.parent = le32_to_cpu(rec.parent);
+    item.flags = le32_to_cpu(rec.flags) & PROC_OPTION_FLAGS;
+    if (fork_tracepoint == NULL)
+    {
+        // Restore what can be, forks cannot be followed without the hook
+        item.flags &= ~PROC_FOLLOW_FORKS;
+    }
+    item.action = le32_to_cpu(rec.action);
+    item.rate = le32_to_cpu(rec.rate);
+    item.budget = le64_to_cpu(rec.budget);
+    
+    if (item.pid <= 0 || item.pid >= PID_MAX_LIMIT || item.action > ACTION_KILL || item.rate > 100)
+    {
+        rs->skipped++;
+        return;
+    }
+    
+    // Processes that exited while the module was out are not brought back
+    task = find_get_pid(item.pid);
+    if (task == NULL)
+    {
+        rs->skipped++;
+        return;
+    }
+    
+    // Nor are they confused with a new process that got the same PID
+    rcu_read_lock();
+    process = pid_task(task, PIDTYPE_PID);
+    if (process == NULL)
+    {
+        same = false;
+    }
+    else if (rs->record_size < sizeof(rec))
+    {
+        same = process->start_time < loaded_at;
+    }
+    else
+    {
+        same = process->start_time == le64_to_cpu(rec.start_time);
+    }
+    rcu_read_unlock();
+    if (!same)
+    {
+        put_pid(task);
+        rs->skipped++;
+        return;
+    }
+    
+    // The restoring user takes the place of the one who registered
+    if (_check_owner(&item, task))
+    {
+        put_pid(task);
+        rs->skipped++;
+        return;
+    }
+    
+    do
+    {
+        ret = _table_reserve(reg, ACCESS_ONCE(reg->table.count) + 1);
+        if (ret)
+        {
+            break;
+        }
+        
+        spin_lock(&reg->table_lock);
+        ret = _table_insert(reg, &item, task);
+        if (ret == 0)
+        {
+            // Bring back the history, the next sweep takes fresh baselines
+            slot = _table_find(reg, item.pid, &found);
+            reg->table.cpu_use[slot] = le64_to_cpu(rec.cpu_use);
+            if (switch_pids == NULL)
+            {
+                reg->table.oncpu_ns[slot] = le64_to_cpu(rec.oncpu_ns);
+            }
+            for (b = 0; b < BURST_BUCKETS; b++)
+            {
+                reg->table.hist[slot][b] = le32_to_cpu(rec.hist[b]);
+            }
+            for (b = 0; b < WAIT_WINDOW; b++)
+            {
+                reg->table.waits[slot][b] = le32_to_cpu(rec.waits[b]);
+            }
+            reg->table.wait_count[slot] = le32_to_cpu(rec.wait_count);
+        }
+        spin_unlock(&reg->table_lock);
+    } while (ret == -ENOSPC);
+    
+    if (ret)
+    {
+        put_pid(task);
+        rs->skipped++;
+        return;
+    }
+    
+    rs->restored++;
+}
+
+// Write a dump back, it may arrive in pieces of any size
+static ssize_t _registry_write_callback(struct file *file, const char __user *buffer, size_t count, loff_t *data)
+{
+    struct proc_registry *reg = global_registry;
+    struct restore_state *rs = file->private_data;
+    size_t done = 0, want;
+    u32 version;
+    u64 gen;
+    
+    while (done < count)
+    {
+        // Header first
+        if (rs->record == NULL)
+        {
+            want = min_t(size_t, sizeof(struct registry_header) - rs->have, count - done);
+            if (copy_from_user((u8 *)&rs->header + rs->have, buffer + done, want))
+            {
+                return -EFAULT;
+            }
+            rs->have += want;
+            done += want;
+            
+            if (rs->have < sizeof(struct registry_header))
+            {
+                break;
+            }
+            
+            // Each version has exactly one record layout
+            rs->record_size = le32_to_cpu(rs->header.record_size);
+            version = le32_to_cpu(rs->header.version);
+            if (memcmp(rs->header.magic, "MP1R", 4) != 0
+                || (version == 1 && rs->record_size != REGISTRY_V1_RECORD)
+                || (version == REGISTRY_VERSION && rs->record_size != sizeof(struct registry_record))
+                || version == 0 || version > REGISTRY_VERSION)
+            {
+                return -EINVAL;
+            }
+            
+            rs->record = (u8 *)kmalloc(rs->record_size, GFP_KERNEL);
+            if (rs->record == NULL)
+            {
+                return -ENOMEM;
+            }
+            rs->remaining = le32_to_cpu(rs->header.count);
+            rs->have = 0;
+            
+            // Keep generations increasing across the reload, clients that
+            //  synced with the old module missed removals and need a full dump
+            gen = le64_to_cpu(rs->header.gen);
+            spin_lock(&reg->table_lock);
+            if (gen > reg->sweep_gen)
+            {
+                reg->sweep_gen = gen;
+            }
+            reg->tomb_floor = max(reg->tomb_floor, reg->sweep_gen + 1);
+            spin_unlock(&reg->table_lock);
+            
+            continue;
+        }
+        
+        if (rs->remaining == 0)
+        {
+            return -EINVAL;
+        }
+        
+        want = min_t(size_t, rs->record_size - rs->have, count - done);
+        if (copy_from_user(rs->record + rs->have, buffer + done, want))
+        {
+            return -EFAULT;
+        }
+        rs->have += want;
+        done += want;
+        
+        if (rs->have == rs->record_size)
+        {
+            _restore_record(rs);
+            rs->have = 0;
+            rs->remaining--;
+        }
+    }
+    
+    return count;
+}
+
+static int _registry_release_callback(struct inode *inode, struct file *file)
+{
+    struct restore_state *rs;
+    
+    if (file->f_mode & FMODE_READ)
+    {
+        return single_release(inode, file);
+    }
+    
+    rs = file->private_data;
+    
+    #ifdef DEBUG
+    printk(KERN_INFO "MP1 restored %u processes, skipped %u\n", rs->restored, rs->skipped);
+    #endif
+    if (rs->record == NULL || rs->remaining != 0)
+    {
+        printk(KERN_WARNING "MP1 registry restore ended early, %u records missing\n", rs->remaining);
+    }
+    
+    kfree(rs->record);
+    kfree(rs);
+    
+    return 0;
+}
 
-static struct proc_dir_entry *mp1, *status;
-static unsigned long procfs_buffer_size = 0;
-static char procfs_buffer[PROCFS_MAX_SIZE];
-static struct timer_list update_timer;
-static struct workqueue_struct *update_workqueue;
-static spinlock_t list_lock;
+// Only a dump is a seq_file, a restore is a stream
+static loff_t _registry_llseek_callback(struct file *file, loff_t offset, int whence)
+{
+    if (file->f_mode & FMODE_READ)
+    {
+        return seq_lseek(file, offset, whence);
+    }
+    
+    return -ESPIPE;
+}
 
-/* Function forward declaration */
+static const struct file_operations registry_proc_fops = {
+    .owner = THIS_MODULE,
+    .open = _registry_open_callback,
+    .read = seq_read,
+    .write = _registry_write_callback,
+    .llseek = _registry_llseek_callback,
+    .release = _registry_release_callback,
+};
 
-static int _proc_show_callback(struct seq_file *sf, void *v);
-static int _proc_open_callback(struct inode *inode, struct file *file);
-static ssize_t _proc_write_callback(struct file *file, const char __user *buffer, size_t count, loff_t *data);
+/* Periodic timer per 5s */
 
-void _update_timer_handler(unsigned long data);
-static void update_work(struct work_struct *work);
+// Step 1:
+// Timer handler in TOP HALF, when the timer expires (interrupt)
+void _update_timer_handler(unsigned long data)
+{
+    struct proc_registry *reg = (struct proc_registry *)data;
+    
+    // Enqueue the registry's work immediately for later execution,
+    //  it is embedded in the registry since nothing can be allocated here
+    queue_work(update_workqueue, &reg->work);
+    
+    // Restart the timer
+    mod_timer(&reg->timer, jiffies + reg->period);
+}
 
-/* Linked list item for each registered process */
+/* Workqueue for timer handler to defer the cpu_use updates */
 
-struct proc_item
+// Step 2:
+// Work function in BOTTOM HALF, when the work is dequeued to execute by executor
+static void update_work(struct work_struct *work)
 {
-    // Data fields
-    int pid;
-    unsigned long cpu_use;
+    struct proc_registry *reg = container_of(work, struct proc_registry, work);
+    struct task_struct *task;
+    struct proc_snapshot *snap;
+    struct snap_entry *entry;
+    unsigned long last_cpu_use, now;
+    unsigned int capacity, tombs, i, kept, first;
     
-    // Linked list member
-    struct list_head list;
-};
-
-// Init a list
-LIST_HEAD(proc_list);
+    // Keep room for the forks followed until the next sweep,
+    //  the fork probe cannot grow the table itself
+    capacity = ACCESS_ONCE(reg->table.count);
+    _table_reserve(reg, capacity + capacity / 4 + TABLE_MIN_CAPACITY / 2);
+    if (ACCESS_ONCE(reg->pending_count))
+    {
+        queue_work(update_workqueue, &reg->grow_work);
+    }
+    
+    // Collect the context switches since the last sweep,
+    //  the merge takes every registry's table_lock itself
+    if (switch_cpus != NULL)
+    {
+        _switch_merge();
+    }
+    
+    // Allocate the next snapshot before taking the lock,
+    //  try again if registrations came in meanwhile
+    for (;;)
+    {
+        // Only the sweep itself adds removals, at most one per row
+        capacity = ACCESS_ONCE(reg->table.count);
+        tombs = reg->tomb_ring != NULL ? min_t(unsigned int, reg->tomb_head + capacity, TOMB_RING_SIZE) : 0;
+        snap = _snap_alloc(capacity, tombs);
+        
+        // The work function runs asynchronously,
+        //  so locking for the table is necessary
+        //  in case registrations are updating it simultaneously
+        spin_lock(&reg->table_lock);
+        if (snap == NULL || reg->table.count <= capacity)
+        {
+            break;
+        }
+        spin_unlock(&reg->table_lock);
+        _snap_put(snap);
+    }
+    
+    // Stamp changes in this sweep with a new generation
+    reg->sweep_gen++;
+    now = jiffies;
+    
+    // Update each row, packing the live rows towards the front
+    rcu_read_lock();
+    for (i = 0, kept = 0; i < reg->table.count; i++)
+    {
+        task = pid_task(reg->table.task[i], PIDTYPE_PID);
+        
+        // If the process is terminated,
+        //  delete it from the table
+        if (task == NULL)
+        {
+            if (reg->table.flags[i] & PROC_FOLLOW_FORKS)
+            {
+                atomic_dec(&follow_count);
+            }
+            if (switch_pids != NULL)
+            {
+                // Another registry may track a new process that reused the PID
+                if (find_vpid(reg->table.pid[i]) == NULL)
+                {
+                    clear_bit(reg->table.pid[i], switch_pids);
+                }
+                reg->table.cpu_use[i] = (unsigned long)nsecs_to_cputime(reg->table.oncpu_ns[i]);
+            }
+            
+            // Short-lived processes may never show up in a snapshot,
+            //  report what they used on the way out
+            _post_event(reg, reg->table.pid[i], EVENT_EXIT, reg->table.cpu_use[i]);
+            _bury(reg, reg->table.pid[i]);
+            put_pid(reg->table.task[i]);
+            continue;
+        }
+        
+        if (kept != i)
+        {
+            _table_copy(&reg->table, kept, &reg->table, i, 1);
+        }
+        
+        // In exact mode the merge above has done the accounting already
+        last_cpu_use = reg->table.cpu_use[kept];
+        if (switch_pids != NULL)
+        {
+            reg->table.cpu_use[kept] = (unsigned long)nsecs_to_cputime(reg->table.oncpu_ns[kept]);
+        }
+        else
+        {
+            reg->table.cpu_use[kept] = task->utime;
+        }
+        _sample_wait(reg, kept, task);
+        _sample_metrics(reg, kept, task);
+        _check_limits(reg, kept, task, last_cpu_use, now - reg->table.stamp[kept]);
+        reg->table.stamp[kept] = now;
+        if (reg->table.cpu_use[kept] != last_cpu_use)
+        {
+            reg->table.changed_gen[kept] = reg->sweep_gen;
+        }
+        
+        // Copy the fresh sample into the snapshot
+        if (snap != NULL)
+        {
+            entry = &snap->entries[snap->count++];
+            entry->pid = reg->table.pid[kept];
+            entry->parent = reg->table.parent[kept];
+            entry->cpu_use = reg->table.cpu_use[kept];
+            entry->changed_gen = reg->table.changed_gen[kept];
+            if (switch_pids != NULL)
+            {
+                entry->oncpu_ns = reg->table.oncpu_ns[kept];
+                memcpy(entry->hist, reg->table.hist[kept], sizeof(burst_hist_t));
+            }
+            _wait_percentiles(reg, kept, entry);
+            entry->metrics = reg->table.flags[kept] & PROC_METRICS;
+            entry->rss = reg->table.rss[kept];
+            entry->min_flt = reg->table.min_flt[kept];
+            entry->maj_flt = reg->table.maj_flt[kept];
+            entry->read_bytes = reg->table.read_bytes[kept];
+            entry->write_bytes = reg->table.write_bytes[kept];
+        }
+        
+        kept++;
+    }
+    rcu_read_unlock();
+    
+    // Rows moved, the index has to follow
+    if (kept != reg->table.count)
+    {
+        reg->table.count = kept;
+        _table_reindex(&reg->table);
+    }
+    
+    if (snap != NULL)
+    {
+        snap->gen = reg->sweep_gen;
+        snap->tomb_floor = reg->tomb_floor;
+        
+        // Copy the remembered removals, oldest first
+        first = reg->tomb_head > tombs ? reg->tomb_head - tombs : 0;
+        for (i = first; i < reg->tomb_head; i++)
+        {
+            snap->tombs[snap->tomb_count++] = reg->tomb_ring[i % TOMB_RING_SIZE];
+        }
+    }
 
-/* I/O of the ProcFS */
+    spin_unlock(&reg->table_lock);
+    
+    // Readers that open from now on see this sweep,
+    //  keep the previous snapshot if there was no memory for a new one
+    if (snap != NULL)
+    {
+        // Readers get PID order, the table is not sorted
+        sort(snap->entries, snap->count, sizeof(struct snap_entry), _snap_entry_cmp, NULL);
+        _snap_publish(reg, snap);
+    }
+}
 
-static const struct file_operations cpu_proc_fops = {
-    .owner = THIS_MODULE,
-    .open = _proc_open_callback,
-    .read = seq_read,
-    .write = _proc_write_callback,
-    .llseek = seq_lseek,
-    .release = single_release,
-};
+/* Registry lifecycle */
 
-// Read the 'status' entry
-static int _proc_open_callback(struct inode *inode, struct file *file)
+// Whether a registry other than self has the PID registered
+static bool _registered_elsewhere(struct proc_registry *self, int pid)
 {
-    return single_open(file, _proc_show_callback, NULL);
+    struct proc_registry *reg;
+    bool found = false;
+    
+    spin_lock(&registries_lock);
+    list_for_each_entry(reg, &registries, list)
+    {
+        if (reg == self)
+        {
+            continue;
+        }
+        
+        spin_lock(&reg->table_lock);
+        _table_find(reg, pid, &found);
+        spin_unlock(&reg->table_lock);
+        
+        if (found)
+        {
+            break;
+        }
+    }
+    spin_unlock(&registries_lock);
+    
+    return found;
 }
 
-static int _proc_show_callback(struct seq_file *sf, void *v)
+// Returns the new registry or an ERR_PTR, -EUSERS if the user has too many sessions open
+static struct proc_registry *_registry_create(unsigned long period, bool session)
 {
-    struct proc_item *cur;
+    struct proc_registry *reg, *other;
+    unsigned int sessions = 0;
     
-    spin_lock(&list_lock);
+    reg = (struct proc_registry *)kzalloc(sizeof(struct proc_registry), GFP_KERNEL);
+    if (reg == NULL)
+    {
+        return ERR_PTR(-ENOMEM);
+    }
     
-    // Iterate the proc_list,
-    //  print to the console "[PID]: [cpu_use]" for each registered process
-    list_for_each_entry(cur, &proc_list, list)
+    spin_lock_init(&reg->table_lock);
+    spin_lock_init(&reg->snap_lock);
+    spin_lock_init(&reg->events.lock);
+    init_waitqueue_head(&reg->events.wait);
+    
+    // Readers always have a snapshot to bind to, start with an empty one
+    reg->current_snap = _snap_alloc(0, 0);
+    if (reg->current_snap == NULL)
     {
-        seq_printf(sf, "%d: %lu\n", cur->pid, cur->cpu_use);
+        kfree(reg);
+        return ERR_PTR(-ENOMEM);
     }
     
-    spin_unlock(&list_lock);
+    // Start with room for a few registrations
+    if (_table_alloc(&reg->table, TABLE_MIN_CAPACITY))
+    {
+        _registry_free(reg);
+        return ERR_PTR(-ENOMEM);
+    }
     
-    return 0;
+    // Removals are only remembered for clients of 'export'
+    if (!session)
+    {
+        reg->tomb_ring = (struct proc_tomb *)vzalloc(TOMB_RING_SIZE * sizeof(struct proc_tomb));
+        if (reg->tomb_ring == NULL)
+        {
+            _registry_free(reg);
+            return ERR_PTR(-ENOMEM);
+        }
+    }
+    
+    INIT_WORK(&reg->work, update_work);
+    INIT_WORK(&reg->grow_work, _grow_work);
+    INIT_LIST_HEAD(&reg->pending);
+    setup_timer(&reg->timer, _update_timer_handler, (unsigned long)reg);
+    reg->period = period;
+    reg->session = session;
+    reg->owner = current_uid();
+    
+    // Every sweep merges for all registries, so one user may only add a few.
+    //  Visible to the fork and switch accounting from now on.
+    spin_lock(&registries_lock);
+    list_for_each_entry(other, &registries, list)
+    {
+        if (other->session && uid_eq(other->owner, reg->owner))
+        {
+            sessions++;
+        }
+    }
+    if (session && sessions >= SESSION_MAX_PER_USER)
+    {
+        spin_unlock(&registries_lock);
+        _registry_free(reg);
+        return ERR_PTR(-EUSERS);
+    }
+    list_add_tail(&reg->list, &registries);
+    spin_unlock(&registries_lock);
+    
+    // Start the timer
+    mod_timer(&reg->timer, jiffies + reg->period);
+    
+    return reg;
 }
 
-// Write the 'status' entry
-static ssize_t _proc_write_callback(struct file *file, const char __user *buffer, size_t count, loff_t *data)
+static void _registry_destroy(struct proc_registry *reg)
 {
-    // Allocate a new node
-    struct proc_item *new = (struct proc_item *)kmalloc(sizeof(struct proc_item), GFP_KERNEL);
+    struct proc_pending *pending, *next;
+    unsigned int i;
+    
+    spin_lock(&registries_lock);
+    list_del(&reg->list);
+    spin_unlock(&registries_lock);
     
-    // Restrict procfs_buffer_size
-    procfs_buffer_size = count;
-    if (procfs_buffer_size > PROCFS_MAX_SIZE)
+    // Stop the sweeps, the timer may queue the work once more before it is gone
+    del_timer_sync(&reg->timer);
+    cancel_work_sync(&reg->work);
+    cancel_work_sync(&reg->grow_work);
+    
+    list_for_each_entry_safe(pending, next, &reg->pending, list)
     {
-        procfs_buffer_size = PROCFS_MAX_SIZE;
+        atomic_dec(&follow_count);
+        put_pid(pending->task);
+        kfree(pending);
     }
     
-    // Get input (PID) from user space
-    if (copy_from_user(procfs_buffer, buffer, procfs_buffer_size))
+    for (i = 0; i < reg->table.count; i++)
     {
-        return -EFAULT;
+        // Limits are no longer enforced, do not leave throttled processes stopped behind
+        if (reg->table.flags[i] & PROC_STOPPED)
+        {
+            kill_pid(reg->table.task[i], SIGCONT, 1);
+        }
+        if (reg->table.flags[i] & PROC_FOLLOW_FORKS)
+        {
+            atomic_dec(&follow_count);
+        }
+        if (switch_pids != NULL && !_registered_elsewhere(reg, reg->table.pid[i]))
+        {
+            clear_bit(reg->table.pid[i], switch_pids);
+        }
+        
+        put_pid(reg->table.task[i]);
     }
     
-    // Initialize the node item for the input PID
-    kstrtoint(procfs_buffer, 0, &new->pid);
-    new->cpu_use = 0;
-    INIT_LIST_HEAD(&new->list);
-    
-    // Register the new item to the proc_list
-    spin_lock(&list_lock);
-    list_add(&new->list, &proc_list);
-    spin_unlock(&list_lock);
+    _registry_free(reg);
+}
+
+// Free the storage of a registry that is not in the list
+static void _registry_free(struct proc_registry *reg)
+{
+    vfree(reg->table.block);
+    vfree(reg->tomb_ring);
     
-    return procfs_buffer_size;
+    // Readers still holding a snapshot keep it alive
+    _snap_put(reg->current_snap);
+    kfree(reg);
 }
 
-/* Periodic timer per 5s */
+/* Sessions
+ *
+ * Writing to 'session' registers processes like 'status' does, reading it
+ * shows only those processes. After "read=events" reads return the session's
+ * own notifications like the 'events' entry does, and poll reports them,
+ * "read=status" switches back. "period=<ms>" changes how often they are swept,
+ * no more often than every SESSION_MIN_PERIOD_MS. Each user may have
+ * SESSION_MAX_PER_USER sessions open.
+ */
 
-// Step 1:
-// Timer handler in TOP HALF, when the timer expires (interrupt)
-void _update_timer_handler(unsigned long data)
+static const struct file_operations session_proc_fops = {
+    .owner = THIS_MODULE,
+    .open = _session_open_callback,
+    .read = _session_read_callback,
+    .write = _session_write_callback,
+    .poll = _session_poll_callback,
+    .llseek = seq_lseek,
+    .release = _session_release_callback,
+};
+
+static int _session_open_callback(struct inode *inode, struct file *file)
 {
-    // Create a work to do update_work
-    struct work_struct *work = (struct work_struct *)kmalloc(sizeof(struct work_struct), GFP_KERNEL);
-    INIT_WORK(work, update_work);
+    struct proc_registry *reg;
+    int ret;
+    
+    reg = _registry_create(UPDATE_PERIOD, true);
+    if (IS_ERR(reg))
+    {
+        return PTR_ERR(reg);
+    }
     
-    // Enqueue the work immediately for later execution
-    queue_work(update_workqueue, work);
+    ret = single_open(file, _session_show_callback, reg);
+    if (ret)
+    {
+        _registry_destroy(reg);
+    }
     
-    // Restart the timer
-    mod_timer(&update_timer, jiffies + 5 * HZ);
+    return ret;
 }
 
-/* Workqueue for timer handler to defer the cpu_use updates */
-
-// Step 2:
-// Work function in BOTTOM HALF, when the work is dequeued to execute by executor
-static void update_work(struct work_struct *work)
+// Every read shows the latest sweep of the session
+static int _session_show_callback(struct seq_file *sf, void *v)
 {
-    struct proc_item *cur, *temp;
+    struct proc_snapshot *snap = _snap_get(sf->private);
     
-    printk(KERN_INFO "This is from work function\n");
+    _show_snapshot(sf, snap);
+    _snap_put(snap);
     
-    // The works in workqueue are asynchronous,
-    //  so locking for the proc_list is necessary even if no other functions will access it
-    //  in case multiple works are updating the list items simultaneously
-    spin_lock(&list_lock);    
+    return 0;
+}
 
-    // Update each item
-    list_for_each_entry_safe(cur, temp, &proc_list, list)
+static ssize_t _session_write_callback(struct file *file, const char __user *buffer, size_t count, loff_t *data)
+{
+    struct proc_registry *reg = ((struct seq_file *)file->private_data)->private;
+    unsigned int ms;
+    char *input;
+    int ret;
+    
+    if (count > PROCFS_MAX_SIZE - 1)
+    {
+        count = PROCFS_MAX_SIZE - 1;
+    }
+    
+    // Sessions write concurrently, so no shared buffer here
+    input = (char *)kmalloc(count + 1, GFP_KERNEL);
+    if (input == NULL)
+    {
+        return -ENOMEM;
+    }
+    if (copy_from_user(input, buffer, count))
+    {
+        kfree(input);
+        return -EFAULT;
+    }
+    input[count] = '\0';
+    
+    if (strcmp(input, "read=events") == 0 || strcmp(input, "read=events\n") == 0)
+    {
+        reg->read_events = true;
+        ret = 0;
+    }
+    else if (strcmp(input, "read=status") == 0 || strcmp(input, "read=status\n") == 0)
     {
-        if (get_cpu_use(cur->pid, &cur->cpu_use) == -1)
-            // If the process is terminated,
-            //  delete it from the proc_list
+        reg->read_events = false;
+        ret = 0;
+    }
+    else if (strncmp(input, "period=", 7) == 0)
+    {
+        ret = kstrtouint(input + 7, 10, &ms);
+        if (ret == 0 && ms == 0)
+        {
+            ret = -EINVAL;
+        }
+        if (ret == 0)
         {
-            list_del(&cur->list);
-            kfree(cur);
+            // Short periods cost every registry a merge, keep them reasonable
+            reg->period = msecs_to_jiffies(max_t(unsigned int, ms, SESSION_MIN_PERIOD_MS));
+            mod_timer(&reg->timer, jiffies + reg->period);
         }
     }
+    else
+    {
+        ret = _register(reg, input);
+    }
+    
+    kfree(input);
+    if (ret)
+    {
+        return ret;
+    }
+    
+    return count;
+}
+
+static ssize_t _session_read_callback(struct file *file, char __user *buffer, size_t count, loff_t *data)
+{
+    struct proc_registry *reg = ((struct seq_file *)file->private_data)->private;
+    
+    if (ACCESS_ONCE(reg->read_events))
+    {
+        return _events_read(&reg->events, file, buffer, count);
+    }
+    
+    return seq_read(file, buffer, count, data);
+}
+
+static unsigned int _session_poll_callback(struct file *file, poll_table *wait)
+{
+    struct proc_registry *reg = ((struct seq_file *)file->private_data)->private;
+    
+    return _events_poll(&reg->events, file, wait);
+}
 
-    spin_unlock(&list_lock);
+static int _session_release_callback(struct inode *inode, struct file *file)
+{
+    _registry_destroy(((struct seq_file *)file->private_data)->private);
     
-    // This work is done
-    kfree(work);
+    return single_release(inode, file);
 }
 
 // Init module
 static int __init _cpu_proc_init(void)
 {
+    int cpu;
+
     #ifdef DEBUG
     printk(KERN_ALERT "MP1 MODULE LOADING\n");
     #endif
+    
+    loaded_at = ktime_get_ns();
+    
+    // Init work queue
+    update_workqueue = create_workqueue("update_workqueue");
+    if (update_workqueue == NULL)
+    {
+        return -ENOMEM;
+    }
+    
+    // The registry behind 'status', swept every 5s
+    global_registry = _registry_create(UPDATE_PERIOD, false);
+    if (IS_ERR(global_registry))
+    {
+        destroy_workqueue(update_workqueue);
+        return PTR_ERR(global_registry);
+    }
 
+    // Hook everything before the files exist, no registration can reach the
+    //  probes or the exact accounting state until then
+    
+    // Hook process creation for "follow" registrations
+    fork_tracepoint = _find_tracepoint("sched_process_fork");
+    if (fork_tracepoint == NULL || tracepoint_probe_register(fork_tracepoint, _fork_probe, NULL))
+    {
+        printk(KERN_WARNING "MP1 cannot hook sched_process_fork, forks will not be followed\n");
+        fork_tracepoint = NULL;
+    }
+    
+    // Hook context switches for exact accounting, fall back to sampling if that fails
+    if (exact)
+    {
+        switch_pids = (unsigned long *)vzalloc(BITS_TO_LONGS(PID_MAX_LIMIT) * sizeof(unsigned long));
+        switch_cpus = alloc_percpu(struct switch_cpu);
+        switch_tracepoint = _find_tracepoint("sched_switch");
+        
+        if (switch_cpus != NULL)
+        {
+            for_each_possible_cpu(cpu)
+            {
+                raw_spin_lock_init(&per_cpu_ptr(switch_cpus, cpu)->lock);
+            }
+        }
+        
+        if (switch_pids == NULL || switch_cpus == NULL || switch_tracepoint == NULL
+            || tracepoint_probe_register(switch_tracepoint, _switch_probe, NULL))
+        {
+            printk(KERN_WARNING "MP1 cannot hook sched_switch, sampling utime instead\n");
+            vfree(switch_pids);
+            free_percpu(switch_cpus);
+            switch_pids = NULL;
+            switch_cpus = NULL;
+            switch_tracepoint = NULL;
+            exact = false;
+        }
+    }
+    
     // Create 'mp1' dir
     mp1 = proc_mkdir(DIRECTORY, NULL);
 
     // Create 'status' file
     status = proc_create(FILENAME, 0666, mp1, &cpu_proc_fops);
     
-    // Create timer of 5s
-    init_timer(&update_timer);
-    update_timer.expires = jiffies + 5 * HZ;
-    update_timer.function = _update_timer_handler;
+    // Create 'events' file
+    events = proc_create(EVENTS_FILENAME, 0444, mp1, &events_proc_fops);
     
-    // Start the timer
-    add_timer(&update_timer);
+    // Create 'export' file
+    export = proc_create(EXPORT_FILENAME, 0666, mp1, &export_proc_fops);
     
-    // Init work queue
-    update_workqueue = create_workqueue("update_workqueue");
+    // Create 'registry' file
+    registry = proc_create(REGISTRY_FILENAME, 0600, mp1, &registry_proc_fops);
     
-    // Init spin lock
-    spin_lock_init(&list_lock);
+    // Create 'session' file
+    session = proc_create(SESSION_FILENAME, 0666, mp1, &session_proc_fops);
     
     printk(KERN_ALERT "MP1 MODULE LOADED\n");
     return 0;    
@@ -206,33 +3027,64 @@ static int __init _cpu_proc_init(void)
 // Exit module
 static void __exit _cpu_proc_exit(void)
 {
-    struct proc_item *cur, *temp;
+    struct proc_registry *reg;
     
     #ifdef DEBUG
     printk(KERN_ALERT "MP1 MODULE UNLOADING\n");
     #endif
     
-    // Compelete works and delete the queue
-    flush_workqueue(update_workqueue);
-    destroy_workqueue(update_workqueue);
-    
-    // Delete the timer
-    del_timer_sync(&update_timer);
-    
-    // Free the nodes
-    spin_lock(&list_lock);
-    list_for_each_entry_safe(cur, temp, &proc_list, list)
+    // Wake up readers blocked on events that would never come,
+    //  removing the files below would wait for them forever
+    ACCESS_ONCE(unloading) = true;
+    spin_lock(&registries_lock);
+    list_for_each_entry(reg, &registries, list)
     {
-        list_del(&cur->list);
-        kfree(cur);
+        wake_up_interruptible_all(&reg->events.wait);
     }
-    spin_unlock(&list_lock);
+    spin_unlock(&registries_lock);
+    
+    // Remove the files before the registries go away, removing a file waits
+    //  for callers still inside it and releases its open sessions
+    
+    // Remove 'session' file
+    remove_proc_entry(SESSION_FILENAME, mp1);
+    
+    // Remove 'registry' file
+    remove_proc_entry(REGISTRY_FILENAME, mp1);
+    
+    // Remove 'export' file
+    remove_proc_entry(EXPORT_FILENAME, mp1);
+    
+    // Remove 'events' file
+    remove_proc_entry(EVENTS_FILENAME, mp1);
     
     // Remove 'status' file
     remove_proc_entry("status", mp1);
 
     // Remove 'mp1' dir
     remove_proc_entry("mp1", NULL);
+    
+    // Unhook process creation and context switches, wait for running probes to finish
+    if (fork_tracepoint != NULL)
+    {
+        tracepoint_probe_unregister(fork_tracepoint, _fork_probe, NULL);
+    }
+    if (switch_tracepoint != NULL)
+    {
+        tracepoint_probe_unregister(switch_tracepoint, _switch_probe, NULL);
+    }
+    tracepoint_synchronize_unregister();
+    
+    // Stop the sweeps and free the table
+    _registry_destroy(global_registry);
+    
+    // Compelete works and delete the queue
+    flush_workqueue(update_workqueue);
+    destroy_workqueue(update_workqueue);
+    
+    // Exact accounting state, nothing uses it once the probe is gone
+    free_percpu(switch_cpus);
+    vfree(switch_pids);
 
     printk(KERN_ALERT "MP1 MODULE UNLOADED\n");
 }